@@ -46,7 +46,72 @@ enum Opcodes {
 	INSTR_SQRT,
 	INSTR_NEW,
 	INSTR_THISCALL,
+	INSTR_ADDN,				// 栈顶的n个值依次相加，用于 a + b + c 这样的连加和字符串拼接
 	INSTR_HALT,
+
+	// ----载入时降级产生的内部指令，操作数种类编码在操作码中(见lower.cpp)
+
+	INSTR_PUSH_LOCAL,		// push 局部变量
+	INSTR_PUSH_GLOBAL,		// push 全局变量
+	INSTR_PUSH_INDEXED,		// push 变址的数组元素
+	INSTR_PUSH_IMM,			// push 常量池中的立即数
+	INSTR_PUSH_REG,			// push _RetVal
+	INSTR_POP_LOCAL,
+	INSTR_POP_GLOBAL,
+	INSTR_POP_INDEXED,
+	INSTR_POP_REG,
+	INSTR_CALL_HOST,		// 调用宿主函数
+
+	// ----特化指令：执行时由通用的算术/比较指令就地改写而来(见dispatch.cpp)
+
+	INSTR_ADD_INT,
+	INSTR_SUB_INT,
+	INSTR_MUL_INT,
+	INSTR_DIV_INT,
+	INSTR_MOD_INT,
+	INSTR_ADD_FLOAT,
+	INSTR_SUB_FLOAT,
+	INSTR_MUL_FLOAT,
+	INSTR_DIV_FLOAT,
+	INSTR_JE_INT,
+	INSTR_JNE_INT,
+	INSTR_JG_INT,
+	INSTR_JL_INT,
+	INSTR_JGE_INT,
+	INSTR_JLE_INT,
+	INSTR_JE_FLOAT,
+	INSTR_JNE_FLOAT,
+	INSTR_JG_FLOAT,
+	INSTR_JL_FLOAT,
+	INSTR_JGE_FLOAT,
+	INSTR_JLE_FLOAT,
+
+	// ----超级指令：降级时由常见的指令序列融合而来(见lower.cpp)，S = 栈变量，I = 立即数
+
+	INSTR_CMP_JE,			// Jcc T; ICONST0; JMP E; T: ICONST1; E: BRFALSE X
+	INSTR_CMP_JNE,
+	INSTR_CMP_JG,
+	INSTR_CMP_JL,
+	INSTR_CMP_JGE,
+	INSTR_CMP_JLE,
+	INSTR_CMP_JE_SS,		// PUSH S; PUSH S; CMP_Jcc
+	INSTR_CMP_JNE_SS,
+	INSTR_CMP_JG_SS,
+	INSTR_CMP_JL_SS,
+	INSTR_CMP_JGE_SS,
+	INSTR_CMP_JLE_SS,
+	INSTR_CMP_JE_SI,		// PUSH S; PUSH I; CMP_Jcc
+	INSTR_CMP_JNE_SI,
+	INSTR_CMP_JG_SI,
+	INSTR_CMP_JL_SI,
+	INSTR_CMP_JGE_SI,
+	INSTR_CMP_JLE_SI,
+	INSTR_ADD_SS,			// PUSH S; PUSH S; ADD
+	INSTR_ADD_SI,
+	INSTR_SUB_SS,
+	INSTR_SUB_SI,
+	INSTR_MOV_SS,			// PUSH S; POP S
+	INSTR_MOV_SI,			// PUSH I; POP S
 };
 
 #endif /* __BYTECODE_H__ */
@@ -56,6 +56,10 @@ char ppstrMnemonics[][12] =
         "fconst0",
         "fconst1",
         "trap",
+        "sqrt",
+        "new",
+        "thiscall",
+        "addn",
 };
 
 // 标号，用于记录前向引用
@@ -2,6 +2,7 @@
 
 #include "code_emit.h"
 #include "../vm.h"
+#include "../polystr.h"
 #include "linked_list.h"
 
 #include <vector>
@@ -148,10 +149,7 @@ void EmitFunc(script_env *pSC, FuncNode *pFunc, int iFuncIndex)
 
                 case OP_TYPE_STRING_INDEX:
                 {
-                    char *str = GetStringByIndex(&g_StringTable, pOp->iStringIndex);
-                    oprand->String = (char *)malloc(strlen(str) + 1);
-                    strcpy(oprand->String, str);
-                    oprand->String[strlen(str)] = '\0';
+                    oprand->String = pSC->StringTable.StringPool[pOp->iStringIndex];
                     oprand->Type = OP_TYPE_STRING;
                 }
                 //fprintf(g_pOutputFile, "\"%s\"", GetStringByIndex(&g_StringTable, pOp->iStringIndex));
@@ -196,6 +194,7 @@ void EmitFunc(script_env *pSC, FuncNode *pFunc, int iFuncIndex)
                     {
                         oprand->Type = OP_TYPE_HOST_CALL_INDEX;
                         oprand->FuncIndex = GetHostFuncIndex(fn->pstrName);
+                        oprand->OffsetIndex = pOp->iOffset; // 实参个数
                         assert(oprand->FuncIndex >= 0);
                     }
                     else
@@ -285,8 +284,12 @@ void EmitFunc(script_env *pSC, FuncNode *pFunc, int iFuncIndex)
 
 void EmitCode(script_env *pSC)
 {
-    // 设置堆栈大小
-    pSC->iStackSize = 1024;
+    // 请求的堆栈大小，0表示使用默认的初始大小，堆栈在运行时按需增长
+    pSC->iStackSize = g_ScriptHeader.iStackSize;
+
+    // 调度优先级
+    pSC->PriorityType = g_ScriptHeader.iPriorityType;
+    pSC->UserPriority = g_ScriptHeader.iUserPriority;
 
     // ---- Emit global variable declarations
 
@@ -294,6 +297,8 @@ void EmitCode(script_env *pSC)
 
     EmitScopeSymbols(pSC, SCOPE_GLOBAL, SYMBOL_TYPE_VAR, 0);
 
+    // 每次编译都从指令流的开头生成
+    g_iCurrInstr = 0;
     InitInstrStream(pSC);
 
     // Local node for traversing lists
@@ -351,6 +356,21 @@ void EmitCode(script_env *pSC)
         }
     }
 
+    // 创建字符串常量表，相同的字符串常量只驻留一份
+
+    pSC->StringTable.Size = g_StringTable.iNodeCount;
+
+    if (pSC->StringTable.Size > 0)
+    {
+        pSC->StringTable.StringPool = (char **)calloc(1, pSC->StringTable.Size * sizeof(char *));
+        pNode = g_StringTable.pHead;
+        for (int i = 0; i < pSC->StringTable.Size; ++i)
+        {
+            pSC->StringTable.StringPool[i] = Str_NewInterned((char *)pNode->pData);
+            pNode = pNode->pNext;
+        }
+    }
+
     // 创建VM函数表
 
     pSC->FuncTable.Size = g_FuncTable.iNodeCount - g_HostFuncTable.iNodeCount;
@@ -372,6 +392,13 @@ void EmitCode(script_env *pSC)
 
         if (!pCurrFunc->iIsHostAPI)
         {
+            // 函数表中不含Host函数，Main()的运行时索引需要在这里重新确定
+            if (g_ScriptHeader.iIsMainFuncPresent && pCurrFunc->iIndex == g_ScriptHeader.iMainFuncIndex)
+            {
+                pSC->IsMainFuncPresent = TRUE;
+                pSC->MainFuncIndex = i;
+            }
+
             EmitFunc(pSC, pCurrFunc, i);
             i++;
         }
@@ -423,7 +450,11 @@ void InitInstrStream(script_env *env)
         node = node->pNext;
     }
 
-    // 分配内存
-    env->InstrStream.Instrs = (INSTR *)malloc(iInstrStreamSize * sizeof(INSTR));
+    // 分配内存，末尾多出一条INSTR_HALT作为哨兵，分发循环因此不必检查指令流边界
+    env->InstrStream.Instrs = (INSTR *)malloc((iInstrStreamSize + 1) * sizeof(INSTR));
     env->InstrStream.Size = iInstrStreamSize;
+
+    env->InstrStream.Instrs[iInstrStreamSize].Opcode = INSTR_HALT;
+    env->InstrStream.Instrs[iInstrStreamSize].OpCount = 0;
+    env->InstrStream.Instrs[iInstrStreamSize].pOpList = NULL;
 }
@@ -368,10 +368,11 @@ void AddArrayIndexVarICodeOp(int iFuncIndex, int iInstrIndex, int iArraySymbolIn
 *
 *   AddFuncICodeOp()
 *
-*   Adds a function operand to the specified I-code instruction.
+*   Adds a function operand to the specified I-code instruction. The number of parameters
+*   pushed by the call is kept in the offset field.
 */
 
-void AddFuncICodeOp(int iFuncIndex, int iInstrIndex, int iOpFuncIndex)
+void AddFuncICodeOp(int iFuncIndex, int iInstrIndex, int iOpFuncIndex, int iParamCount)
 {
     // Create an operand structure to hold the new value
 
@@ -381,6 +382,7 @@ void AddFuncICodeOp(int iFuncIndex, int iInstrIndex, int iOpFuncIndex)
 
     Value.iType = OP_TYPE_FUNC_INDEX;
     Value.iFuncIndex = iOpFuncIndex;
+    Value.iOffset = iParamCount;
 
     // Add the operand to the instruction
 
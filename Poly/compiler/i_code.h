@@ -82,7 +82,7 @@ void AddStringICodeOp(int iFuncIndex, int iInstrIndex, int iStringIndex);
 void AddVarICodeOp(int iFuncIndex, int iInstrIndex, int iSymbolIndex);
 void AddArrayIndexAbsICodeOp(int iFuncIndex, int iInstrIndex, int iArraySymbolIndex, int iOffset);
 void AddArrayIndexVarICodeOp(int iFuncIndex, int iInstrIndex, int iArraySymbolIndex, int iOffsetSymbolIndex);
-void AddFuncICodeOp(int iFuncIndex, int iInstrIndex, int iOpFuncIndex);
+void AddFuncICodeOp(int iFuncIndex, int iInstrIndex, int iOpFuncIndex, int iParamCount);
 void AddRegICodeOp(int iFuncIndex, int iInstrIndex, int iRegCode);
 
 Label DefineLabel();
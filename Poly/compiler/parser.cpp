@@ -32,6 +32,7 @@ void ParseLogical();
 void ParseEquality();
 void ParseRelationality();
 void ParseSubExpr();
+void EmitAddChain(int iCount);
 void ParseTerm();
 void ParseUnary();
 void ParseFactor();
@@ -521,6 +522,7 @@ void ParseStatement()
 
     default:
         // 可能是无副作用的表达式语句或者不合法的语句
+        RewindTokenStream();
         AddICodeAnnotation(g_iCurrScope, GetCurrSourceLine());
         ParseExpr();
         ReadToken(TOKEN_TYPE_SEMICOLON);
@@ -1228,6 +1230,11 @@ void ParseSubExpr()
 
     int iOpType;
 
+    // 连续相加的项数。a + b + c + d 的各项先全部压栈，再用一条ADDN相加，
+    // 拼接字符串时结果只分配一次
+
+    int iAddCount = 1;
+
     // Parse the first term
 
     ParseTerm();
@@ -1250,29 +1257,47 @@ void ParseSubExpr()
 
         iOpType = GetCurrOp();
 
+        // 减法之前先把已经压栈的各项加起来
+
+        if (iOpType == OP_TYPE_SUB)
+        {
+            EmitAddChain(iAddCount);
+            iAddCount = 1;
+        }
+
         // Parse the second term
 
         ParseTerm();
 
         // Perform the binary operation associated with the specified operator
 
-        int iOpInstr;
-        switch (iOpType)
-        {
-            // Binary addition
-
-        case OP_TYPE_ADD:
-            iOpInstr = INSTR_ADD;
-            break;
+        if (iOpType == OP_TYPE_ADD)
+            ++iAddCount;
+        else
+            AddICodeInstr(g_iCurrScope, INSTR_SUB);
+    }
 
-            // Binary subtraction
+    EmitAddChain(iAddCount);
+}
 
-        case OP_TYPE_SUB:
-            iOpInstr = INSTR_SUB;
-            break;
-        }
+/******************************************************************************************
+*
+*   EmitAddChain()
+*
+*   Adds up the iCount terms on top of the stack: nothing for a single term, ADD for two,
+*   ADDN for a longer chain.
+*/
 
-        AddICodeInstr(g_iCurrScope, iOpInstr);
+void EmitAddChain(int iCount)
+{
+    if (iCount == 2)
+    {
+        AddICodeInstr(g_iCurrScope, INSTR_ADD);
+    }
+    else if (iCount > 2)
+    {
+        int iInstrIndex = AddICodeInstr(g_iCurrScope, INSTR_ADDN);
+        AddIntICodeOp(g_iCurrScope, iInstrIndex, iCount);
     }
 }
 
@@ -2241,5 +2266,5 @@ void ParseFuncCall()
 
     int iInstrIndex = AddICodeInstr(g_iCurrScope, iCallInstr);
 
-    AddFuncICodeOp(g_iCurrScope, iInstrIndex, pFunc->iIndex);
+    AddFuncICodeOp(g_iCurrScope, iInstrIndex, pFunc->iIndex, iParamCount);
 }
\ No newline at end of file
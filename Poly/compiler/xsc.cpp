@@ -78,6 +78,7 @@ static void InitCompiler()
     g_ScriptHeader.iIsMainFuncPresent = FALSE;
     g_ScriptHeader.iStackSize = 0;
     g_ScriptHeader.iPriorityType = PRIORITY_NONE;
+    g_ScriptHeader.iUserPriority = 0;
 
     // ---- Initialize the main settings
 
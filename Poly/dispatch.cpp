@@ -0,0 +1,981 @@
+/* 直接线索化(direct threading)的指令分发引擎，执行lower.cpp生成的预解码指令 */
+
+#include "bytecode.h"
+#include "dispatch.h"
+#include "gc.h"
+#include "instruction.h"
+#include "polystr.h"
+#include <limits.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+// ----Dispatch Macros ---------------------------------------------------------------------
+//
+// 每条指令的处理代码以TARGET()开头，以NEXT()/JUMP()/DISPATCH()结束。
+// 支持labels-as-values时，每个处理代码的末尾都直接跳转到下一条指令的处理代码，
+// 否则所有TARGET()展开为同一个switch中的case。
+// 指令预算用尽时，在执行下一条指令之前返回。
+// 分发时读到的操作码保存在iOpcode中，共用处理代码的指令由它区分，不再读pc->Opcode。
+
+#ifdef POLY_COMPUTED_GOTO
+#define TARGET(op) L_##op:
+#define DISPATCH_OPCODE(op) goto *s_DispatchTable[iOpcode = (op)]
+#else
+#define TARGET(op) case op:
+#define DISPATCH_OPCODE(op) \
+    do                      \
+    {                       \
+        iOpcode = (op);     \
+        goto Dispatch;      \
+    } while (0)
+#endif
+
+#define DISPATCH()                              \
+    do                                          \
+    {                                           \
+        if (++iInstrCount > iInstrLimit)        \
+            goto Yield;                         \
+        DISPATCH_OPCODE(LOAD_OPCODE(pc));       \
+    } while (0)
+
+#define NEXT()      \
+    do              \
+    {               \
+        ++pc;       \
+        DISPATCH(); \
+    } while (0)
+
+#define JUMP(i)                 \
+    do                          \
+    {                           \
+        pc = pInstrs + (i);     \
+        DISPATCH();             \
+    } while (0)
+
+// 只在向后跳转和函数调用处检查时间片，并且距上次读取时钟至少执行了
+// TIMESLICE_CHECK_INTERVAL条指令，避免频繁读取时钟
+#define CHECK_TIMESLICE()                                                       \
+    do                                                                          \
+    {                                                                           \
+        if (iInstrCount >= iNextClockCheck)                                     \
+        {                                                                       \
+            iNextClockCheck = iInstrCount + TIMESLICE_CHECK_INTERVAL;           \
+            if (GetCurrTime() > iTimesliceEndTime)                              \
+                goto Exit;                                                      \
+        }                                                                       \
+    } while (0)
+
+// 跳转到指令i，向后跳转时检查时间片
+#define BRANCH(i)                           \
+    do                                      \
+    {                                       \
+        int iTarget = (i);                  \
+        if (pInstrs + iTarget <= pc)        \
+        {                                   \
+            pc = pInstrs + iTarget;         \
+            CHECK_TIMESLICE();              \
+            DISPATCH();                     \
+        }                                   \
+        JUMP(iTarget);                      \
+    } while (0)
+
+// ----Quickening --------------------------------------------------------------------------
+//
+// 通用的算术/比较指令执行时，如果两个操作数都是整数或都是浮点数，就把自己就地改写为
+// 对应的特化指令。特化指令只检查操作数类型是否仍然匹配，不匹配时恢复为通用指令并重新
+// 执行。
+//
+// 代码由共享同一个程序的所有实例共用，不同线程上的实例可能同时改写同一条指令，所以
+// 操作码用relaxed原子操作读写。写入的总是同一条指令的某个有效版本，哪个线程最后写入
+// 都不影响结果；去特化后直接执行通用版本，不再读共享的操作码。
+
+#ifdef _MSC_VER
+#define LOAD_OPCODE(pc) __iso_volatile_load32((const volatile int *)&(pc)->Opcode)
+#define STORE_OPCODE(pc, op) __iso_volatile_store32((volatile int *)&(pc)->Opcode, (op))
+#else
+#define LOAD_OPCODE(pc) __atomic_load_n(&(pc)->Opcode, __ATOMIC_RELAXED)
+#define STORE_OPCODE(pc, op) __atomic_store_n(&(pc)->Opcode, (op), __ATOMIC_RELAXED)
+#endif
+
+#define DEQUICKEN(generic)                  \
+    do                                      \
+    {                                       \
+        STORE_OPCODE(pc, (generic));        \
+        DISPATCH_OPCODE(generic);           \
+    } while (0)
+
+// 特化的二元运算，结果就地写入第一个操作数
+#define QUICK_BINARY(op, generic, type, field, oper)                \
+    TARGET(op)                                                      \
+    {                                                               \
+        PolyObject &op0 = sc->stack[sc->iTopIndex - 2];             \
+        const PolyObject &op1 = sc->stack[sc->iTopIndex - 1];       \
+        if (op0.Type != type || op1.Type != type)                   \
+            DEQUICKEN(generic);                                     \
+        op0.field = op0.field oper op1.field;                       \
+        --sc->iTopIndex;                                            \
+        NEXT();                                                     \
+    }
+
+// 特化的条件跳转
+#define QUICK_COMPARE(op, generic, type, field, oper)               \
+    TARGET(op)                                                      \
+    {                                                               \
+        const PolyObject &op0 = sc->stack[sc->iTopIndex - 2];       \
+        const PolyObject &op1 = sc->stack[sc->iTopIndex - 1];       \
+        if (op0.Type != type || op1.Type != type)                   \
+            DEQUICKEN(generic);                                     \
+        sc->iTopIndex -= 2;                                         \
+        if (op0.field oper op1.field)                               \
+            BRANCH(pc->A);                                          \
+        NEXT();                                                     \
+    }
+
+// ----Superinstructions ------------------------------------------------------------------
+//
+// 融合的指令序列见lower.cpp。iInstrCount按被融合的原指令计数，与switch引擎报告的指令数一致。
+
+// 比较并跳转：条件不成立时跳转到目标，否则跳过生成布尔值的指令
+#define FUSED_CMP(op, jcc, oper, x, y, pushes, target)                  \
+    TARGET(op)                                                          \
+    {                                                                   \
+        const PolyObject &op0 = x;                                      \
+        const PolyObject &op1 = y;                                      \
+        int iCond;                                                      \
+        if (op0.Type == OP_TYPE_INT && op1.Type == OP_TYPE_INT)         \
+            iCond = op0.Fixnum oper op1.Fixnum;                         \
+        else                                                            \
+            iCond = CompareValues(jcc, op0, op1);                       \
+        sc->iTopIndex -= 2 - (pushes);                                  \
+        if (!iCond)                                                     \
+        {                                                               \
+            iInstrCount += (pushes) + 3;                                \
+            BRANCH(target);                                             \
+        }                                                               \
+        iInstrCount += (pushes) + 2;                                    \
+        pc += (pushes) + 5;                                             \
+        DISPATCH();                                                     \
+    }
+
+#define FUSED_CMP_ALL(cond, oper)                                                          \
+    FUSED_CMP(INSTR_CMP_##cond, INSTR_##cond, oper,                                        \
+              sc->stack[sc->iTopIndex - 2], sc->stack[sc->iTopIndex - 1], 0, pc->A)        \
+    FUSED_CMP(INSTR_CMP_##cond##_SS, INSTR_##cond, oper,                                   \
+              *StackSlot(sc, pc->A), *StackSlot(sc, pc->B), 2, pc->C)                      \
+    FUSED_CMP(INSTR_CMP_##cond##_SI, INSTR_##cond, oper,                                   \
+              *StackSlot(sc, pc->A), pConsts[pc->B], 2, pc->C)
+
+// 两个操作数直接从栈变量/常量池读取的二元运算
+#define FUSED_BINARY(op, fn, oper, y)                                   \
+    TARGET(op)                                                          \
+    {                                                                   \
+        const PolyObject &op0 = *StackSlot(sc, pc->A);                  \
+        const PolyObject &op1 = y;                                      \
+        PolyObject op2;                                                 \
+        if (op0.Type == OP_TYPE_INT && op1.Type == OP_TYPE_INT)         \
+        {                                                               \
+            op2.Type = OP_TYPE_INT;                                     \
+            op2.Fixnum = op0.Fixnum oper op1.Fixnum;                    \
+        }                                                               \
+        else                                                            \
+        {                                                               \
+            op2.Type = OP_TYPE_NULL;                                    \
+            fn(op0, op1, op2);                                          \
+        }                                                               \
+        PushResult(sc, &op2);                                           \
+        iInstrCount += 2;                                               \
+        pc += 3;                                                        \
+        DISPATCH();                                                     \
+    }
+
+// 返回操作数类型对应的特化操作码，没有特化版本时返回原操作码。
+// 依赖bytecode.h中ADD..MOD、JE..JLE与各自特化指令的顺序一致
+static inline int QuickenedOpcode(int iOpcode, const PolyObject &Op0, const PolyObject &Op1)
+{
+    if (Op0.Type != Op1.Type)
+        return iOpcode;
+
+    if (Op0.Type == OP_TYPE_INT)
+    {
+        if (iOpcode >= INSTR_ADD && iOpcode <= INSTR_MOD)
+            return INSTR_ADD_INT + (iOpcode - INSTR_ADD);
+        if (iOpcode >= INSTR_JE && iOpcode <= INSTR_JLE)
+            return INSTR_JE_INT + (iOpcode - INSTR_JE);
+    }
+    else if (Op0.Type == OP_TYPE_FLOAT)
+    {
+        if (iOpcode >= INSTR_ADD && iOpcode <= INSTR_DIV)
+            return INSTR_ADD_FLOAT + (iOpcode - INSTR_ADD);
+        if (iOpcode >= INSTR_JE && iOpcode <= INSTR_JLE)
+            return INSTR_JE_FLOAT + (iOpcode - INSTR_JE);
+    }
+
+    return iOpcode;
+}
+
+// ----Stack Helpers -----------------------------------------------------------------------
+
+// 与ResolveStackIndex()相同：负索引相对于当前栈帧
+static inline PolyObject *StackSlot(script_env *sc, int iIndex)
+{
+    return &sc->stack[iIndex < 0 ? iIndex + sc->iFrameIndex : iIndex];
+}
+
+// 变址：偏移量保存在iOffsetIndex处的变量中。全局变量基址为正，局部变量基址为负
+static inline PolyObject *IndexedSlot(script_env *sc, int iBaseIndex, int iOffsetIndex)
+{
+    int iOffset = StackSlot(sc, iOffsetIndex)->Fixnum;
+    if (iBaseIndex >= 0)
+        return StackSlot(sc, iBaseIndex + iOffset);
+    return StackSlot(sc, iBaseIndex - iOffset);
+}
+
+// 解析常量池中的通用操作数，返回它对应的值
+static inline PolyObject *ResolveOperand(script_env *sc, PolyObject *pOp)
+{
+    switch (pOp->Type)
+    {
+    case OP_TYPE_ABS_STACK_INDEX:
+        return StackSlot(sc, pOp->StackIndex);
+
+    case OP_TYPE_REL_STACK_INDEX:
+        return IndexedSlot(sc, pOp->StackIndex, pOp->OffsetIndex);
+
+    case OP_TYPE_REG:
+        return &sc->_RetVal;
+    }
+
+    return pOp;
+}
+
+// 字符串需要维护引用计数，其他值直接复制
+static inline void PushValue(script_env *sc, PolyObject *pVal)
+{
+    PolyObject *pTop = &sc->stack[sc->iTopIndex++];
+    if (pTop->Type == OP_TYPE_STRING || pVal->Type == OP_TYPE_STRING)
+        CopyValue(pTop, pVal);
+    else
+        *pTop = *pVal;
+}
+
+// 压入运算结果。结果中的字符串是新创建的，栈槽直接接管它的引用
+static inline void PushResult(script_env *sc, PolyObject *pVal)
+{
+    PolyObject *pTop = &sc->stack[sc->iTopIndex++];
+    if (pTop->Type == OP_TYPE_STRING)
+        Str_Release(pTop->String);
+    *pTop = *pVal;
+}
+
+static inline void StoreValue(PolyObject *pDest, PolyObject *pVal)
+{
+    if (pDest->Type == OP_TYPE_STRING || pVal->Type == OP_TYPE_STRING)
+        CopyValue(pDest, pVal);
+    else
+        *pDest = *pVal;
+}
+
+// 条件跳转：比较栈顶的两个值
+static inline int CompareValues(int iOpcode, const PolyObject &Op0, const PolyObject &Op1)
+{
+    switch (iOpcode)
+    {
+    case INSTR_JE:
+        switch (Op0.Type)
+        {
+        case OP_TYPE_INT:
+            return Op0.Fixnum == Op1.Fixnum;
+        case OP_TYPE_FLOAT:
+            return Op0.Realnum == Op1.Realnum;
+        case OP_TYPE_STRING:
+            return Str_Equal(Op0.String, Op1.String);
+        }
+        return FALSE;
+
+    case INSTR_JNE:
+        switch (Op0.Type)
+        {
+        case OP_TYPE_INT:
+            return Op0.Fixnum != Op1.Fixnum;
+        case OP_TYPE_FLOAT:
+            return Op0.Realnum != Op1.Realnum;
+        case OP_TYPE_STRING:
+            return !Str_Equal(Op0.String, Op1.String);
+        }
+        return FALSE;
+
+    case INSTR_JG:
+        if (Op0.Type == OP_TYPE_INT)
+            return Op0.Fixnum > Op1.Fixnum;
+        return Op0.Realnum > Op1.Realnum;
+
+    case INSTR_JL:
+        if (Op0.Type == OP_TYPE_INT)
+            return Op0.Fixnum < Op1.Fixnum;
+        return Op0.Realnum < Op1.Realnum;
+
+    case INSTR_JGE:
+        if (Op0.Type == OP_TYPE_INT)
+            return Op0.Fixnum >= Op1.Fixnum;
+        return Op0.Realnum >= Op1.Realnum;
+
+    case INSTR_JLE:
+        if (Op0.Type == OP_TYPE_INT)
+            return Op0.Fixnum <= Op1.Fixnum;
+        return Op0.Realnum <= Op1.Realnum;
+    }
+
+    return FALSE;
+}
+
+// BRTRUE/BRFALSE的真值判断
+static inline int IsTrue(const PolyObject &Op0)
+{
+    switch (Op0.Type)
+    {
+    case OP_TYPE_INT:
+        return Op0.Fixnum != 0;
+    case OP_TYPE_FLOAT:
+        return Op0.Realnum != 0;
+    case OP_TYPE_STRING:
+        return Op0.String[0] != '\0';
+    }
+    return FALSE;
+}
+
+/******************************************************************************************
+*
+*    ExecuteInstructionsThreaded()
+*
+*    Runs the currently loaded script for a given timeslice duration, or for at most
+*    iInstrBudget instructions. Unlike the switch based loop in vm.cpp, it runs the
+*    pre-decoded instructions in sc->Code and neither reads the clock nor checks the
+*    stream bounds on every instruction: the stream ends with an INSTR_HALT sentinel, the
+*    timeslice is checked on backward jumps and calls only, and pauses are checked only
+*    after the instructions that can cause them.
+*/
+
+void ExecuteInstructionsThreaded(script_env *sc, int iTimesliceDur, int iInstrBudget)
+{
+#ifdef POLY_COMPUTED_GOTO
+    // 顺序必须与bytecode.h中的Opcodes一致
+    static void *s_DispatchTable[] = {
+        &&L_INSTR_NOP,
+        &&L_INSTR_BREAK,
+        &&L_INSTR_MOV,
+        &&L_INSTR_ADD,
+        &&L_INSTR_SUB,
+        &&L_INSTR_MUL,
+        &&L_INSTR_DIV,
+        &&L_INSTR_MOD,
+        &&L_INSTR_EXP,
+        &&L_INSTR_NEG,
+        &&L_INSTR_INC,
+        &&L_INSTR_DEC,
+        &&L_INSTR_AND,
+        &&L_INSTR_OR,
+        &&L_INSTR_XOR,
+        &&L_INSTR_NOT,
+        &&L_INSTR_SHL,
+        &&L_INSTR_SHR,
+        &&L_INSTR_JMP,
+        &&L_INSTR_JE,
+        &&L_INSTR_JNE,
+        &&L_INSTR_JG,
+        &&L_INSTR_JL,
+        &&L_INSTR_JGE,
+        &&L_INSTR_JLE,
+        &&L_INSTR_BRTRUE,
+        &&L_INSTR_BRFALSE,
+        &&L_INSTR_PUSH,
+        &&L_INSTR_POP,
+        &&L_INSTR_DUP,
+        &&L_INSTR_REMOVE,
+        &&L_INSTR_CALL,
+        &&L_INSTR_RET,
+        &&L_INSTR_PAUSE,
+        &&L_INSTR_ICONST0,
+        &&L_INSTR_ICONST1,
+        &&L_INSTR_FCONST_0,
+        &&L_INSTR_FCONST_1,
+        &&L_INSTR_TRAP,
+        &&L_INSTR_SQRT,
+        &&L_INSTR_NEW,
+        &&L_INSTR_THISCALL,
+        &&L_INSTR_ADDN,
+        &&L_INSTR_HALT,
+        &&L_INSTR_PUSH_LOCAL,
+        &&L_INSTR_PUSH_GLOBAL,
+        &&L_INSTR_PUSH_INDEXED,
+        &&L_INSTR_PUSH_IMM,
+        &&L_INSTR_PUSH_REG,
+        &&L_INSTR_POP_LOCAL,
+        &&L_INSTR_POP_GLOBAL,
+        &&L_INSTR_POP_INDEXED,
+        &&L_INSTR_POP_REG,
+        &&L_INSTR_CALL_HOST,
+        &&L_INSTR_ADD_INT,
+        &&L_INSTR_SUB_INT,
+        &&L_INSTR_MUL_INT,
+        &&L_INSTR_DIV_INT,
+        &&L_INSTR_MOD_INT,
+        &&L_INSTR_ADD_FLOAT,
+        &&L_INSTR_SUB_FLOAT,
+        &&L_INSTR_MUL_FLOAT,
+        &&L_INSTR_DIV_FLOAT,
+        &&L_INSTR_JE_INT,
+        &&L_INSTR_JNE_INT,
+        &&L_INSTR_JG_INT,
+        &&L_INSTR_JL_INT,
+        &&L_INSTR_JGE_INT,
+        &&L_INSTR_JLE_INT,
+        &&L_INSTR_JE_FLOAT,
+        &&L_INSTR_JNE_FLOAT,
+        &&L_INSTR_JG_FLOAT,
+        &&L_INSTR_JL_FLOAT,
+        &&L_INSTR_JGE_FLOAT,
+        &&L_INSTR_JLE_FLOAT,
+        &&L_INSTR_CMP_JE,
+        &&L_INSTR_CMP_JNE,
+        &&L_INSTR_CMP_JG,
+        &&L_INSTR_CMP_JL,
+        &&L_INSTR_CMP_JGE,
+        &&L_INSTR_CMP_JLE,
+        &&L_INSTR_CMP_JE_SS,
+        &&L_INSTR_CMP_JNE_SS,
+        &&L_INSTR_CMP_JG_SS,
+        &&L_INSTR_CMP_JL_SS,
+        &&L_INSTR_CMP_JGE_SS,
+        &&L_INSTR_CMP_JLE_SS,
+        &&L_INSTR_CMP_JE_SI,
+        &&L_INSTR_CMP_JNE_SI,
+        &&L_INSTR_CMP_JG_SI,
+        &&L_INSTR_CMP_JL_SI,
+        &&L_INSTR_CMP_JGE_SI,
+        &&L_INSTR_CMP_JLE_SI,
+        &&L_INSTR_ADD_SS,
+        &&L_INSTR_ADD_SI,
+        &&L_INSTR_SUB_SS,
+        &&L_INSTR_SUB_SI,
+        &&L_INSTR_MOV_SS,
+        &&L_INSTR_MOV_SI,
+    };
+#endif
+
+    CODE *pInstrs = sc->Code.Codes;
+    PolyObject *pConsts = sc->Code.Consts;
+    CODE *pc;
+    int iOpcode;
+
+    unsigned long long iInstrCount = 0;
+    unsigned long long iInstrLimit =
+        (iInstrBudget == INFINITE_INSTR_BUDGET) ? ULLONG_MAX : (unsigned long long)iInstrBudget;
+
+    // 无限时间片不需要读取时钟
+    int iHasTimeslice = (iTimesliceDur != POLY_INFINITE_TIMESLICE);
+    int iTimesliceEndTime = iHasTimeslice ? GetCurrTime() + iTimesliceDur : 0;
+    unsigned long long iNextClockCheck = iHasTimeslice ? TIMESLICE_CHECK_INTERVAL : ULLONG_MAX;
+
+    if (!sc->IsRunning)
+        return;
+
+    // 如果没有任何指令需要执行，则停止运行
+    if (sc->CurrInstr >= sc->Code.Size)
+    {
+        sc->IsRunning = FALSE;
+        sc->ExitCode = EXIT_SUCCESS;
+        return;
+    }
+
+    // 暂停的脚本由宿主决定何时再运行
+    if (sc->IsPaused)
+        return;
+
+    pc = pInstrs + sc->CurrInstr;
+
+    DISPATCH();
+
+#ifndef POLY_COMPUTED_GOTO
+Dispatch:
+    switch (iOpcode)
+    {
+#endif
+
+    // ----Binary Operations
+
+    TARGET(INSTR_ADD)
+    TARGET(INSTR_SUB)
+    TARGET(INSTR_MUL)
+    TARGET(INSTR_DIV)
+    TARGET(INSTR_MOD)
+    TARGET(INSTR_EXP)
+    TARGET(INSTR_AND)
+    TARGET(INSTR_OR)
+    TARGET(INSTR_XOR)
+    TARGET(INSTR_SHL)
+    TARGET(INSTR_SHR)
+    {
+        // 操作数留在栈上，直接就地读取
+        const PolyObject &op1 = sc->stack[sc->iTopIndex - 1];
+        const PolyObject &op0 = sc->stack[sc->iTopIndex - 2];
+        PolyObject op2;
+        op2.Type = OP_TYPE_NULL;
+
+        // 类型不匹配时不写，避免反复写共享的缓存行
+        int iQuickened = QuickenedOpcode(iOpcode, op0, op1);
+        if (iQuickened != iOpcode)
+            STORE_OPCODE(pc, iQuickened);
+
+        switch (iOpcode)
+        {
+        case INSTR_ADD:
+            exec_add(op0, op1, op2);
+            break;
+        case INSTR_SUB:
+            exec_sub(op0, op1, op2);
+            break;
+        case INSTR_MUL:
+            exec_mul(op0, op1, op2);
+            break;
+        case INSTR_DIV:
+            exec_div(op0, op1, op2);
+            break;
+        case INSTR_MOD:
+            exec_mod(op0, op1, op2);
+            break;
+        case INSTR_EXP:
+            exec_exp(op0, op1, op2);
+            break;
+        case INSTR_AND:
+            exec_and(op0, op1, op2);
+            break;
+        case INSTR_OR:
+            exec_or(op0, op1, op2);
+            break;
+        case INSTR_XOR:
+            exec_xor(op0, op1, op2);
+            break;
+        case INSTR_SHL:
+            exec_shl(op0, op1, op2);
+            break;
+        case INSTR_SHR:
+            exec_shr(op0, op1, op2);
+            break;
+        }
+
+        sc->iTopIndex -= 2;
+        PushResult(sc, &op2);
+        NEXT();
+    }
+
+    TARGET(INSTR_ADDN)
+    {
+        exec_addn(sc, pc->A);
+        NEXT();
+    }
+
+    // ----Unary Operations
+
+    TARGET(INSTR_NEG)
+    {
+        exec_neg(sc->stack[sc->iTopIndex - 1]);
+        NEXT();
+    }
+
+    TARGET(INSTR_NOT)
+    {
+        exec_not(sc->stack[sc->iTopIndex - 1]);
+        NEXT();
+    }
+
+    TARGET(INSTR_INC)
+    {
+        exec_inc(sc->stack[sc->iTopIndex - 1]);
+        NEXT();
+    }
+
+    TARGET(INSTR_DEC)
+    {
+        exec_dec(sc->stack[sc->iTopIndex - 1]);
+        NEXT();
+    }
+
+    TARGET(INSTR_SQRT)
+    {
+        exec_sqrt(sc->stack[sc->iTopIndex - 1]);
+        NEXT();
+    }
+
+    // ----Move
+
+    TARGET(INSTR_MOV)
+    {
+        PolyObject *Dest = ResolveOperand(sc, &pConsts[pc->A]);
+        PolyObject *Source = ResolveOperand(sc, &pConsts[pc->B]);
+        if (Dest != Source)
+            CopyValue(Dest, Source);
+        NEXT();
+    }
+
+    // ----Branching
+
+    TARGET(INSTR_JMP)
+    {
+        BRANCH(pc->A);
+    }
+
+    TARGET(INSTR_JE)
+    TARGET(INSTR_JNE)
+    TARGET(INSTR_JG)
+    TARGET(INSTR_JL)
+    TARGET(INSTR_JGE)
+    TARGET(INSTR_JLE)
+    {
+        const PolyObject &op0 = sc->stack[sc->iTopIndex - 2];
+        const PolyObject &op1 = sc->stack[sc->iTopIndex - 1];
+
+        // 类型不匹配时不写，避免反复写共享的缓存行
+        int iQuickened = QuickenedOpcode(iOpcode, op0, op1);
+        if (iQuickened != iOpcode)
+            STORE_OPCODE(pc, iQuickened);
+
+        int iJump = CompareValues(iOpcode, op0, op1);
+        sc->iTopIndex -= 2;
+        if (iJump)
+            BRANCH(pc->A);
+        NEXT();
+    }
+
+    // ----Quickened Instructions
+
+    QUICK_BINARY(INSTR_ADD_INT, INSTR_ADD, OP_TYPE_INT, Fixnum, +)
+    QUICK_BINARY(INSTR_SUB_INT, INSTR_SUB, OP_TYPE_INT, Fixnum, -)
+    QUICK_BINARY(INSTR_MUL_INT, INSTR_MUL, OP_TYPE_INT, Fixnum, *)
+    QUICK_BINARY(INSTR_DIV_INT, INSTR_DIV, OP_TYPE_INT, Fixnum, /)
+    QUICK_BINARY(INSTR_MOD_INT, INSTR_MOD, OP_TYPE_INT, Fixnum, %)
+    QUICK_BINARY(INSTR_ADD_FLOAT, INSTR_ADD, OP_TYPE_FLOAT, Realnum, +)
+    QUICK_BINARY(INSTR_SUB_FLOAT, INSTR_SUB, OP_TYPE_FLOAT, Realnum, -)
+    QUICK_BINARY(INSTR_MUL_FLOAT, INSTR_MUL, OP_TYPE_FLOAT, Realnum, *)
+    QUICK_BINARY(INSTR_DIV_FLOAT, INSTR_DIV, OP_TYPE_FLOAT, Realnum, /)
+
+    QUICK_COMPARE(INSTR_JE_INT, INSTR_JE, OP_TYPE_INT, Fixnum, ==)
+    QUICK_COMPARE(INSTR_JNE_INT, INSTR_JNE, OP_TYPE_INT, Fixnum, !=)
+    QUICK_COMPARE(INSTR_JG_INT, INSTR_JG, OP_TYPE_INT, Fixnum, >)
+    QUICK_COMPARE(INSTR_JL_INT, INSTR_JL, OP_TYPE_INT, Fixnum, <)
+    QUICK_COMPARE(INSTR_JGE_INT, INSTR_JGE, OP_TYPE_INT, Fixnum, >=)
+    QUICK_COMPARE(INSTR_JLE_INT, INSTR_JLE, OP_TYPE_INT, Fixnum, <=)
+    QUICK_COMPARE(INSTR_JE_FLOAT, INSTR_JE, OP_TYPE_FLOAT, Realnum, ==)
+    QUICK_COMPARE(INSTR_JNE_FLOAT, INSTR_JNE, OP_TYPE_FLOAT, Realnum, !=)
+    QUICK_COMPARE(INSTR_JG_FLOAT, INSTR_JG, OP_TYPE_FLOAT, Realnum, >)
+    QUICK_COMPARE(INSTR_JL_FLOAT, INSTR_JL, OP_TYPE_FLOAT, Realnum, <)
+    QUICK_COMPARE(INSTR_JGE_FLOAT, INSTR_JGE, OP_TYPE_FLOAT, Realnum, >=)
+    QUICK_COMPARE(INSTR_JLE_FLOAT, INSTR_JLE, OP_TYPE_FLOAT, Realnum, <=)
+
+    // ----Superinstructions
+
+    FUSED_CMP_ALL(JE, ==)
+    FUSED_CMP_ALL(JNE, !=)
+    FUSED_CMP_ALL(JG, >)
+    FUSED_CMP_ALL(JL, <)
+    FUSED_CMP_ALL(JGE, >=)
+    FUSED_CMP_ALL(JLE, <=)
+
+    FUSED_BINARY(INSTR_ADD_SS, exec_add, +, *StackSlot(sc, pc->B))
+    FUSED_BINARY(INSTR_ADD_SI, exec_add, +, pConsts[pc->B])
+    FUSED_BINARY(INSTR_SUB_SS, exec_sub, -, *StackSlot(sc, pc->B))
+    FUSED_BINARY(INSTR_SUB_SI, exec_sub, -, pConsts[pc->B])
+
+    TARGET(INSTR_MOV_SS)
+    {
+        PolyObject *Dest = StackSlot(sc, pc->A);
+        PolyObject *Source = StackSlot(sc, pc->B);
+        if (Dest != Source)
+            StoreValue(Dest, Source);
+        ++iInstrCount;
+        pc += 2;
+        DISPATCH();
+    }
+
+    TARGET(INSTR_MOV_SI)
+    {
+        StoreValue(StackSlot(sc, pc->A), &pConsts[pc->B]);
+        ++iInstrCount;
+        pc += 2;
+        DISPATCH();
+    }
+
+    TARGET(INSTR_BRTRUE)
+    TARGET(INSTR_BRFALSE)
+    {
+        int iJump = IsTrue(sc->stack[--sc->iTopIndex]);
+        if (pc->Opcode == INSTR_BRFALSE)
+            iJump = !iJump;
+        if (iJump)
+            BRANCH(pc->A);
+        NEXT();
+    }
+
+    // ----The Stack Interface
+
+    TARGET(INSTR_PUSH_LOCAL)
+    {
+        PushValue(sc, &sc->stack[sc->iFrameIndex + pc->A]);
+        NEXT();
+    }
+
+    TARGET(INSTR_PUSH_GLOBAL)
+    {
+        PushValue(sc, &sc->stack[pc->A]);
+        NEXT();
+    }
+
+    TARGET(INSTR_PUSH_INDEXED)
+    {
+        PushValue(sc, IndexedSlot(sc, pc->A, pc->B));
+        NEXT();
+    }
+
+    TARGET(INSTR_PUSH_IMM)
+    {
+        PushValue(sc, &pConsts[pc->A]);
+        NEXT();
+    }
+
+    TARGET(INSTR_PUSH_REG)
+    {
+        PushValue(sc, &sc->_RetVal);
+        NEXT();
+    }
+
+    TARGET(INSTR_PUSH)
+    {
+        PushValue(sc, ResolveOperand(sc, &pConsts[pc->A]));
+        NEXT();
+    }
+
+    TARGET(INSTR_POP_LOCAL)
+    {
+        StoreValue(&sc->stack[sc->iFrameIndex + pc->A], &sc->stack[--sc->iTopIndex]);
+        NEXT();
+    }
+
+    TARGET(INSTR_POP_GLOBAL)
+    {
+        StoreValue(&sc->stack[pc->A], &sc->stack[--sc->iTopIndex]);
+        NEXT();
+    }
+
+    TARGET(INSTR_POP_INDEXED)
+    {
+        PolyObject *Dest = IndexedSlot(sc, pc->A, pc->B);
+        StoreValue(Dest, &sc->stack[--sc->iTopIndex]);
+        NEXT();
+    }
+
+    TARGET(INSTR_POP_REG)
+    {
+        StoreValue(&sc->_RetVal, &sc->stack[--sc->iTopIndex]);
+        NEXT();
+    }
+
+    TARGET(INSTR_POP)
+    {
+        PolyObject *Dest = ResolveOperand(sc, &pConsts[pc->A]);
+        StoreValue(Dest, &sc->stack[--sc->iTopIndex]);
+        NEXT();
+    }
+
+    TARGET(INSTR_DUP)
+    {
+        exec_dup(sc);
+        NEXT();
+    }
+
+    TARGET(INSTR_REMOVE)
+    {
+        --sc->iTopIndex;
+        NEXT();
+    }
+
+    TARGET(INSTR_ICONST0)
+    TARGET(INSTR_ICONST1)
+    {
+        PolyObject Source;
+        Source.Type = OP_TYPE_INT;
+        Source.Fixnum = (pc->Opcode == INSTR_ICONST1);
+        PushValue(sc, &Source);
+        NEXT();
+    }
+
+    TARGET(INSTR_FCONST_0)
+    TARGET(INSTR_FCONST_1)
+    {
+        PolyObject Source;
+        Source.Type = OP_TYPE_FLOAT;
+        Source.Realnum = (pc->Opcode == INSTR_FCONST_1) ? 1.f : 0.f;
+        PushValue(sc, &Source);
+        NEXT();
+    }
+
+    // ----The Function Call Interface
+
+    TARGET(INSTR_CALL)
+    {
+        // 与CallFunc()相同的栈帧布局
+        FUNC *DestFunc = &sc->FuncTable.Funcs[pc->A];
+        int iFrameIndex = sc->iFrameIndex;
+
+        // 堆栈无法增长时脚本已经因栈溢出而停止
+        if (!EnsureStack(sc, DestFunc->MaxStackDepth))
+            goto Exit;
+
+        // 保存返回地址（RA）
+        PolyObject ReturnAddr;
+        ReturnAddr.Type = OP_TYPE_INSTR_INDEX;
+        ReturnAddr.InstrIndex = (int)(pc - pInstrs) + 1;
+        PushValue(sc, &ReturnAddr);
+
+        sc->iTopIndex += DestFunc->LocalDataSize + 1;
+        sc->iFrameIndex = sc->iTopIndex;
+
+        // 函数信息块,保存调用者的栈帧索引
+        PolyObject *FuncIndex = &sc->stack[sc->iTopIndex - 1];
+        FuncIndex->Type = OP_TYPE_FUNC_INDEX;
+        FuncIndex->FuncIndex = pc->A;
+        FuncIndex->OffsetIndex = iFrameIndex;
+
+        pc = pInstrs + DestFunc->EntryPoint;
+        CHECK_TIMESLICE();
+        DISPATCH();
+    }
+
+    TARGET(INSTR_CALL_HOST)
+    {
+        // 调用宿主函数，它可能同步调用脚本函数(改变IP)、暂停或停止脚本
+        int iCurrInstr = (int)(pc - pInstrs);
+        sc->CurrInstr = iCurrInstr;
+        CallHostFunc(sc, pc->A, pc->B);
+        if (sc->CurrInstr == iCurrInstr)
+            ++sc->CurrInstr;
+        pc = pInstrs + sc->CurrInstr;
+
+        if (!sc->IsRunning || sc->IsPaused)
+            goto Exit;
+        DISPATCH();
+    }
+
+    TARGET(INSTR_RET)
+    {
+        // 栈顶是函数信息块
+        PolyObject FuncIndex = sc->stack[--sc->iTopIndex];
+
+        assert(FuncIndex.Type == OP_TYPE_FUNC_INDEX ||
+               FuncIndex.Type == OP_TYPE_STACK_BASE_MARKER);
+
+        // 如果是主函数返回，记录退出代码
+        if (sc->IsMainFuncPresent && sc->MainFuncIndex == FuncIndex.FuncIndex)
+            sc->ExitCode = sc->_RetVal.Fixnum;
+
+        // 批量调用的下一行：栈帧和函数信息块留在原处，从入口重新执行
+        if (FuncIndex.Type == OP_TYPE_STACK_BASE_MARKER && sc->Batch)
+        {
+            int iEntryPoint = NextBatchRow(sc);
+            if (iEntryPoint >= 0)
+            {
+                ++sc->iTopIndex;
+                pc = pInstrs + iEntryPoint;
+                DISPATCH();
+            }
+        }
+
+        FUNC *CurrFunc = &sc->FuncTable.Funcs[FuncIndex.FuncIndex];
+
+        // 返回地址位于本地数据的下面
+        int iReturnAddr = sc->stack[sc->iTopIndex - (CurrFunc->LocalDataSize + 1)].InstrIndex;
+
+        // 弹出栈帧和返回地址，恢复调用者的栈帧
+        sc->iTopIndex -= CurrFunc->StackFrameSize;
+        sc->iFrameIndex = FuncIndex.OffsetIndex;
+
+        pc = pInstrs + iReturnAddr;
+
+        // 返回到宿主。由Poly_RunScript()调用的Main()返回时脚本结束
+        if (FuncIndex.Type == OP_TYPE_STACK_BASE_MARKER)
+        {
+            if (sc->IsMainActive && sc->MainFuncIndex == FuncIndex.FuncIndex)
+            {
+                sc->IsMainActive = FALSE;
+                sc->IsRunning = FALSE;
+            }
+            goto Exit;
+        }
+
+        DISPATCH();
+    }
+
+    TARGET(INSTR_TRAP)
+    {
+        exec_trap(sc, CoerceValueToInt(ResolveOperand(sc, &pConsts[pc->A])));
+        NEXT();
+    }
+
+    TARGET(INSTR_NEW)
+    {
+        PolyObject val = NewObject(sc, CoerceValueToInt(ResolveOperand(sc, &pConsts[pc->A])));
+        PushValue(sc, &val);
+        NEXT();
+    }
+
+    TARGET(INSTR_NOP)
+    {
+        NEXT();
+    }
+
+    TARGET(INSTR_BREAK)
+    {
+        // 暂停虚拟机，返回宿主。下一次运行时立即恢复
+        sc->IsPaused = TRUE;
+        sc->PauseEndTime = GetCurrTime();
+        ++pc;
+        goto Exit;
+    }
+
+    TARGET(INSTR_PAUSE)
+    {
+        int iPauseDuration = CoerceValueToInt(ResolveOperand(sc, &pConsts[pc->A]));
+        sc->PauseEndTime = GetCurrTime() + iPauseDuration;
+        sc->IsPaused = TRUE;
+        ++pc;
+        goto Exit;
+    }
+
+    TARGET(INSTR_HALT)
+    {
+        // 指令流末尾的哨兵
+        sc->IsRunning = FALSE;
+        sc->ExitCode = EXIT_SUCCESS;
+        goto Exit;
+    }
+
+    TARGET(INSTR_THISCALL)
+#ifndef POLY_COMPUTED_GOTO
+    default:
+#endif
+    {
+        fprintf(stderr, "VM: 无法识别的指令 '%d'\n", iOpcode);
+        exit(0);
+    }
+
+#ifndef POLY_COMPUTED_GOTO
+    }
+#endif
+
+Yield:
+    // pc处的指令没有执行
+    --iInstrCount;
+
+Exit:
+    sc->CurrInstr = (int)(pc - pInstrs);
+    sc->InstrCount += iInstrCount;
+}
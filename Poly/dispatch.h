@@ -0,0 +1,35 @@
+#ifndef __DISPATCH_H__
+#define __DISPATCH_H__
+
+#include "vm.h"
+
+// -------- Dispatch Engines ----------------------------------
+
+#define INFINITE_INSTR_BUDGET -1    // 不限制执行的指令条数
+#define TIMESLICE_CHECK_INTERVAL 1024 // 时间片模式下，每执行这么多条指令才读取一次时钟
+
+void ExecuteInstructionsThreaded(script_env *sc, int iTimesliceDur, int iInstrBudget);
+
+// -------- Lowering (lower.cpp) ------------------------------
+
+int LowerInstrStream(script_env *sc);
+int MeasureStackDepths(script_env *sc);
+void FreeCodeStream(script_env *sc);
+
+// -------- VM Services (vm.cpp) ------------------------------
+
+int GetCurrTime();
+int CoerceValueToInt(PolyObject *Val);
+void CallHostFunc(script_env *sc, int iHostFuncIndex, int iArgCount);
+void RunGC(script_env *sc);
+PolyObject NewObject(script_env *sc, int iSize);
+int GrowStack(script_env *sc, int iCount);
+int NextBatchRow(script_env *sc);
+
+// 确保栈顶之上还有iCount个槽位。堆栈无法增长时脚本已经停止，返回FALSE
+inline int EnsureStack(script_env *sc, int iCount)
+{
+    return sc->iTopIndex + iCount <= sc->iStackSize || GrowStack(sc, iCount);
+}
+
+#endif	/* __DISPATCH_H__ */
@@ -0,0 +1,207 @@
+/* 在多个工作线程上并行运行相互独立的脚本 */
+
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+#include "poly.h"
+#include "vm.h"
+
+// ----Execution Rules ---------------------------------------------------------------------
+//
+// 每个工作线程拥有一个任务队列。Poly_ExecutorRun()把脚本轮流分配到各个队列，
+// 工作线程从自己队列的尾部取任务，队列空了就从其他线程队列的头部窃取。
+// 脚本运行时不会产生新任务，所以一轮窃取都失败时这批脚本已经全部取走。
+//
+// 一个script_env同一时刻只在一个线程上运行。共享同一个程序的实例之间唯一的写入是
+// 特化改写共享代码中的操作码，它用relaxed原子操作完成，因此执行过程中无需加锁；
+// 只有任务队列需要加锁。
+
+struct WORKER
+{
+    std::mutex Lock;
+    std::deque<script_env *> Tasks; // 待运行的脚本
+    std::thread Thread;
+};
+
+struct poly_executor
+{
+    int ThreadCount;
+    WORKER *Workers;
+
+    std::mutex Lock;
+    std::condition_variable Start; // 新一批任务或退出
+    std::condition_variable Done;  // 所有工作线程都已空闲
+    unsigned int Generation;       // 每批任务递增
+    int Busy;                      // 仍在处理本批任务的工作线程个数
+    int InstrBudget;               // 每个脚本的指令预算，<= 0表示运行到结束或暂停
+    int Quit;
+};
+
+// ----Task Queues ---------------------------------------------------------------------------
+
+static script_env *PopTask(WORKER *pWorker)
+{
+    std::lock_guard<std::mutex> lock(pWorker->Lock);
+    if (pWorker->Tasks.empty())
+        return NULL;
+
+    script_env *sc = pWorker->Tasks.back();
+    pWorker->Tasks.pop_back();
+    return sc;
+}
+
+static script_env *StealTask(poly_executor *ex, int iThief)
+{
+    for (int i = 1; i < ex->ThreadCount; ++i)
+    {
+        WORKER *pVictim = &ex->Workers[(iThief + i) % ex->ThreadCount];
+
+        std::lock_guard<std::mutex> lock(pVictim->Lock);
+        if (pVictim->Tasks.empty())
+            continue;
+
+        script_env *sc = pVictim->Tasks.front();
+        pVictim->Tasks.pop_front();
+        return sc;
+    }
+
+    return NULL;
+}
+
+// ----Workers -------------------------------------------------------------------------------
+
+static void WorkerMain(poly_executor *ex, int iWorker)
+{
+    WORKER *pWorker = &ex->Workers[iWorker];
+    unsigned int uGeneration = 0;
+
+    for (;;)
+    {
+        int iInstrBudget;
+        {
+            std::unique_lock<std::mutex> lock(ex->Lock);
+            ex->Start.wait(lock, [&] { return ex->Quit || ex->Generation != uGeneration; });
+            if (ex->Quit)
+                return;
+            uGeneration = ex->Generation;
+            iInstrBudget = ex->InstrBudget;
+        }
+
+        script_env *sc;
+        while ((sc = PopTask(pWorker)) != NULL || (sc = StealTask(ex, iWorker)) != NULL)
+        {
+            if (iInstrBudget > 0)
+                Poly_RunScriptInstructions(sc, iInstrBudget);
+            else
+                Poly_RunScript(sc, POLY_INFINITE_TIMESLICE);
+        }
+
+        std::lock_guard<std::mutex> lock(ex->Lock);
+        if (--ex->Busy == 0)
+            ex->Done.notify_one();
+    }
+}
+
+/******************************************************************************************
+*
+*  Poly_CreateExecutor()
+*
+*  Starts a pool of worker threads. iThreads <= 0 uses one thread per hardware thread.
+*/
+
+poly_executor *Poly_CreateExecutor(int iThreads)
+{
+    if (iThreads <= 0)
+        iThreads = (int)std::thread::hardware_concurrency();
+    if (iThreads <= 0)
+        iThreads = 1;
+
+    poly_executor *ex = new poly_executor;
+    ex->ThreadCount = iThreads;
+    ex->Workers = new WORKER[iThreads];
+    ex->Generation = 0;
+    ex->Busy = 0;
+    ex->InstrBudget = 0;
+    ex->Quit = FALSE;
+
+    for (int i = 0; i < iThreads; ++i)
+        ex->Workers[i].Thread = std::thread(WorkerMain, ex, i);
+
+    return ex;
+}
+
+/******************************************************************************************
+*
+*  Poly_DestroyExecutor()
+*
+*  Stops and joins the worker threads. The scripts stay owned by the host.
+*/
+
+void Poly_DestroyExecutor(poly_executor *ex)
+{
+    if (!ex)
+        return;
+
+    {
+        std::lock_guard<std::mutex> lock(ex->Lock);
+        ex->Quit = TRUE;
+    }
+    ex->Start.notify_all();
+
+    for (int i = 0; i < ex->ThreadCount; ++i)
+        ex->Workers[i].Thread.join();
+
+    delete[] ex->Workers;
+    delete ex;
+}
+
+/******************************************************************************************
+*
+*  Poly_GetExecutorThreadCount()
+*
+*  Returns the number of worker threads.
+*/
+
+int Poly_GetExecutorThreadCount(poly_executor *ex)
+{
+    return ex->ThreadCount;
+}
+
+/******************************************************************************************
+*
+*  Poly_ExecutorRun()
+*
+*  Runs each script once on the worker threads and waits for all of them: for at most
+*  iInstrBudget instructions, or, if iInstrBudget <= 0, until it ends or pauses. The
+*  scripts must be distinct. Returns the number of scripts that haven't ended.
+*/
+
+int Poly_ExecutorRun(poly_executor *ex, script_env **ppScripts, int iCount, int iInstrBudget)
+{
+    if (iCount <= 0)
+        return 0;
+
+    for (int i = 0; i < iCount; ++i)
+    {
+        WORKER *pWorker = &ex->Workers[i % ex->ThreadCount];
+        std::lock_guard<std::mutex> lock(pWorker->Lock);
+        pWorker->Tasks.push_back(ppScripts[i]);
+    }
+
+    {
+        std::unique_lock<std::mutex> lock(ex->Lock);
+        ex->InstrBudget = iInstrBudget;
+        ex->Busy = ex->ThreadCount;
+        ex->Generation++;
+        ex->Start.notify_all();
+        ex->Done.wait(lock, [&] { return ex->Busy == 0; });
+    }
+
+    int iRunning = 0;
+    for (int i = 0; i < iCount; ++i)
+        if (!Poly_IsScriptStop(ppScripts[i]))
+            iRunning++;
+
+    return iRunning;
+}
@@ -1,82 +1,603 @@
 ﻿#include "gc.h"
+#include "polystr.h"
+#include <limits.h>
 
-// 分配一个有n个字段的新对象
-// ppPrevious指向上一次分配的对象的地址
-PolyObject GC_AllocObject(int iSize, MetaObject **ppPrevious)
+// ----Generations ---------------------------------------------------------------------------
+//
+// 新对象在新生代(nursery)中按地址顺序分配，只需移动指针。新生代满了之后minor GC把
+// 从根、记忆集和已晋升对象可达的新生代对象复制到老年代，剩下的对象随新生代整体清空，
+// 不必逐个释放。老年代对象引用新生代对象时由写屏障(GC_WriteField())记入记忆集。
+// 标记-清除只处理老年代，开始前先做一次minor GC。
+//
+// 老年代的标记和清除都是增量的，和脚本交替进行(三色标记：白色未标记，灰色在灰色栈中，
+// 黑色已扫描)。标记期间写屏障把写入字段的老年代对象涂成灰色，晋升和新分配的对象直接
+// 标记，所以黑色对象不会引用白色对象。栈和寄存器没有写屏障，标记结束前重新扫描它们。
+// 清除期间分配的对象同样被标记，不会被这一轮清除。
+
+#define NURSERY_SIZE (256 * 1024)                   // 新生代的大小
+#define MAX_YOUNG_OBJECT_BYTES (NURSERY_SIZE / 16) // 更大的对象直接分配在老年代
+#define OBJECT_ALIGN 8
+
+static inline size_t ObjectBytes(size_t iSize)
+{
+    return sizeof(MetaObject) + iSize * sizeof(PolyObject);
+}
+
+// 按OBJECT_ALIGN对齐后的对象大小。新生代和slab中的对象都这样相邻排列
+static inline size_t AlignedBytes(size_t iSize)
+{
+    return (ObjectBytes(iSize) + OBJECT_ALIGN - 1) & ~(size_t)(OBJECT_ALIGN - 1);
+}
+
+static void OutOfMemory()
+{
+    fprintf(stderr, "VM: 内存不足\n");
+    exit(1);
+}
+
+// 压入对象指针，内存不足时返回FALSE
+static int PushObject(GC_STACK *pStack, MetaObject *pObject)
+{
+    if (pStack->Top == pStack->Capacity)
+    {
+        int iCapacity = pStack->Capacity ? pStack->Capacity * 2 : 64;
+        MetaObject **pItems = (MetaObject **)realloc(pStack->Items, iCapacity * sizeof(MetaObject *));
+        if (!pItems)
+            return FALSE;
+        pStack->Items = pItems;
+        pStack->Capacity = iCapacity;
+    }
+
+    pStack->Items[pStack->Top++] = pObject;
+    return TRUE;
+}
+
+// ----Marking -------------------------------------------------------------------------------
+//
+// 标记位存放在堆的位图中，按对象编号索引，标记阶段只读对象，不会弄脏存活对象所在的
+// 缓存行。灰色对象(已标记、字段尚未扫描)压入显式的灰色栈，不再递归，任意长的链表
+// 也不会耗尽C栈。灰色栈无法增长时记下溢出，之后扫描整个堆，从已标记的对象继续标记。
+
+#define MARK_BITS 32
+
+static inline int IsMarked(GC_HEAP *pHeap, MetaObject *pObject)
+{
+    return (pHeap->MarkBits[pObject->Id / MARK_BITS] >> (pObject->Id % MARK_BITS)) & 1;
+}
+
+static inline void SetMarked(GC_HEAP *pHeap, MetaObject *pObject)
+{
+    pHeap->MarkBits[pObject->Id / MARK_BITS] |= 1u << (pObject->Id % MARK_BITS);
+}
+
+// 把对象压入灰色栈，内存不足时记下溢出
+static void PushGrey(GC_HEAP *pHeap, MetaObject *pObject)
+{
+    if (!PushObject(&pHeap->Grey, pObject))
+        pHeap->GreyOverflow = TRUE;
+}
+
+// 标记未标记的老年代对象，并让它变成灰色。新生代对象没有编号，也不能留在灰色栈中，
+// 它们由minor GC处理：晋升时在标记期间直接变成灰色
+static inline void Shade(GC_HEAP *pHeap, MetaObject *pObject)
+{
+    if (GC_IsYoung(pHeap, pObject) || IsMarked(pHeap, pObject))
+        return;
+
+    SetMarked(pHeap, pObject);
+    PushGrey(pHeap, pObject);
+}
+
+static void ScanFields(GC_HEAP *pHeap, MetaObject *pObject)
+{
+    PolyObject *pFields = pObject->Mem;
+    for (size_t i = 0; i < pObject->Size; i++)
+        if (pFields[i].Type == OP_TYPE_OBJECT)
+            Shade(pHeap, pFields[i].ObjectPtr);
+}
+
+// 标记根引用的对象，它的字段由GC_Trace()扫描
+void GC_Mark(GC_HEAP *pHeap, PolyObject val)
+{
+    if (val.Type == OP_TYPE_OBJECT)
+        Shade(pHeap, val.ObjectPtr);
+}
+
+// 扫描至多*piWork个灰色对象，*piWork减去扫描的个数。返回TRUE表示灰色栈已空
+int GC_MarkStep(GC_HEAP *pHeap, int *piWork)
+{
+    int iWork = *piWork;
+
+    for (;;)
+    {
+        while (pHeap->Grey.Top > 0 && iWork > 0)
+        {
+            ScanFields(pHeap, pHeap->Grey.Items[--pHeap->Grey.Top]);
+            iWork--;
+        }
+        *piWork = iWork;
+
+        if (pHeap->Grey.Top > 0)
+            return FALSE;
+        if (!pHeap->GreyOverflow)
+            return TRUE;
+
+        // 溢出时丢失的灰色对象都已标记，重新扫描所有已标记对象的字段即可找回
+        pHeap->GreyOverflow = FALSE;
+        for (MetaObject *object = pHeap->Objects; object; object = object->NextObject)
+            if (IsMarked(pHeap, object))
+                ScanFields(pHeap, object);
+    }
+}
+
+// 扫描灰色对象的字段，直到所有可达对象都已标记
+void GC_Trace(GC_HEAP *pHeap)
+{
+    int iWork = INT_MAX;
+    while (!GC_MarkStep(pHeap, &iWork))
+        iWork = INT_MAX;
+}
+
+// ----Slabs ---------------------------------------------------------------------------------
+//
+// 字段不超过GC_SIZE_CLASSES个的老年代对象按字段个数分成大小类，每类一个空闲链表，
+// 空闲块借用NextObject串起。链表空了就分配一个slab(若干页)，按地址顺序切成块，晋升的
+// 对象因此彼此相邻。清除把块还给空闲链表，slab只在销毁堆时整体释放。更大的对象仍然
+// 单独用malloc分配。
+
+#define SLAB_BYTES (16 * 1024) // slab的大小，页大小的整数倍
+
+struct GC_SLAB
+{
+    GC_SLAB *Next;
+};
+
+#define SLAB_HEADER_BYTES ((sizeof(GC_SLAB) + OBJECT_ALIGN - 1) & ~(size_t)(OBJECT_ALIGN - 1))
+
+// 取一个能容纳n个字段的块，内存不足时返回NULL
+static MetaObject *AllocBlock(GC_HEAP *pHeap, size_t iSize)
+{
+    if (iSize > GC_SIZE_CLASSES)
+        return (MetaObject *)malloc(ObjectBytes(iSize));
+
+    MetaObject **ppFree = &pHeap->FreeBlocks[iSize - 1];
+    if (!*ppFree)
+    {
+        GC_SLAB *pSlab = (GC_SLAB *)malloc(SLAB_BYTES);
+        if (!pSlab)
+            return NULL;
+        pSlab->Next = pHeap->Slabs;
+        pHeap->Slabs = pSlab;
+
+        // 倒序压入，链表按地址升序
+        size_t iBytes = AlignedBytes(iSize);
+        char *pFirst = (char *)pSlab + SLAB_HEADER_BYTES;
+        for (size_t i = (SLAB_BYTES - SLAB_HEADER_BYTES) / iBytes; i > 0; i--)
+        {
+            MetaObject *pBlock = (MetaObject *)(pFirst + (i - 1) * iBytes);
+            pBlock->NextObject = *ppFree;
+            *ppFree = pBlock;
+        }
+    }
+
+    MetaObject *pBlock = *ppFree;
+    *ppFree = pBlock->NextObject;
+    return pBlock;
+}
+
+// 把对象的块还给它的大小类
+static void FreeBlock(GC_HEAP *pHeap, MetaObject *pBlock)
+{
+    if (pBlock->Size > GC_SIZE_CLASSES)
+    {
+        free(pBlock);
+        return;
+    }
+
+    MetaObject **ppFree = &pHeap->FreeBlocks[pBlock->Size - 1];
+    pBlock->NextObject = *ppFree;
+    *ppFree = pBlock;
+}
+
+// ----Allocation ----------------------------------------------------------------------------
+
+// 取一个对象编号。位图不够时按倍数扩大，编号回收列表和位图同样大小，不会溢出
+static int AllocId(GC_HEAP *pHeap, unsigned int *pId)
+{
+    if (pHeap->FreeIdCount > 0)
+    {
+        *pId = pHeap->FreeIds[--pHeap->FreeIdCount];
+        return TRUE;
+    }
+
+    if (pHeap->NextId == (unsigned int)pHeap->MarkWords * MARK_BITS)
+    {
+        int iWords = pHeap->MarkWords ? pHeap->MarkWords * 2 : 4;
+
+        unsigned int *pBits = (unsigned int *)realloc(pHeap->MarkBits, iWords * sizeof(unsigned int));
+        if (!pBits)
+            return FALSE;
+        memset(pBits + pHeap->MarkWords, 0, (iWords - pHeap->MarkWords) * sizeof(unsigned int));
+        pHeap->MarkBits = pBits;
+
+        unsigned int *pIds = (unsigned int *)realloc(pHeap->FreeIds, iWords * MARK_BITS * sizeof(unsigned int));
+        if (!pIds)
+            return FALSE;
+        pHeap->FreeIds = pIds;
+
+        pHeap->MarkWords = iWords;
+    }
+
+    *pId = pHeap->NextId++;
+    return TRUE;
+}
+
+// 在老年代中分配有n个字段的对象，字段没有初始化。内存不足时返回NULL
+static MetaObject *AllocOld(GC_HEAP *pHeap, size_t iSize)
+{
+    unsigned int iId;
+    if (!AllocId(pHeap, &iId))
+        return NULL;
+
+    MetaObject *pObject = AllocBlock(pHeap, iSize);
+    if (!pObject)
+    {
+        pHeap->FreeIds[pHeap->FreeIdCount++] = iId;
+        return NULL;
+    }
+
+    pObject->Id = iId;
+    pObject->Flags = 0;
+    pObject->RefCount = 1;
+    pObject->NextObject = pHeap->Objects;
+    pHeap->OldBytes += ObjectBytes(iSize);
+
+    // 回收进行中分配的对象是黑色的，不会被这一轮清除
+    if (pHeap->Phase != GC_PHASE_IDLE)
+        SetMarked(pHeap, pObject);
+    pObject->Size = iSize;
+    pObject->Mem = (PolyObject *)(((char *)pObject) + sizeof(MetaObject));
+
+    // 指向新分配的对象
+    pHeap->Objects = pObject;
+    pHeap->ObjectCount++;
+
+    return pObject;
+}
+
+// 新生代在第一次分配对象时分配，没有对象的脚本不占用它。清零的内存即字段的初值
+static int AllocNursery(GC_HEAP *pHeap)
+{
+    pHeap->Nursery = (char *)calloc(NURSERY_SIZE, 1);
+    if (!pHeap->Nursery)
+        return FALSE;
+
+    pHeap->NurseryTop = pHeap->Nursery;
+    pHeap->NurseryEnd = pHeap->Nursery + NURSERY_SIZE;
+    return TRUE;
+}
+
+int GC_NurseryHasRoom(GC_HEAP *pHeap, int iSize)
+{
+    size_t iBytes = AlignedBytes(iSize);
+    if (iBytes > MAX_YOUNG_OBJECT_BYTES || !pHeap->Nursery)
+        return TRUE;
+    return pHeap->NurseryTop + iBytes <= pHeap->NurseryEnd;
+}
+
+// 分配一个有n个字段的新对象，字段为0。新生代已满或对象太大时分配在老年代。
+// 内存不足时返回空值
+PolyObject GC_AllocObject(GC_HEAP *pHeap, int iSize)
 {
     PolyObject r;
-    size_t byteCount;
-    
+    size_t iBytes = AlignedBytes(iSize);
+
     assert(iSize > 0);
 
-    // Allocate memory
-    byteCount = sizeof(MetaObject) + iSize*sizeof(PolyObject);
-    r.ObjectPtr = (MetaObject *)malloc(byteCount);
-    memset(r.ObjectPtr, 0, byteCount);
+    if (iBytes <= MAX_YOUNG_OBJECT_BYTES && (pHeap->Nursery || AllocNursery(pHeap)) &&
+        pHeap->NurseryTop + iBytes <= pHeap->NurseryEnd)
+    {
+        // 新生代回收后整体清零，这里不必再清零
+        r.ObjectPtr = (MetaObject *)pHeap->NurseryTop;
+        pHeap->NurseryTop += iBytes;
+        pHeap->NurseryBytes += ObjectBytes(iSize);
+        pHeap->YoungCount++;
 
+        r.ObjectPtr->RefCount = 1;
+        r.ObjectPtr->Size = iSize;
+        r.ObjectPtr->Mem = (PolyObject *)(((char *)r.ObjectPtr) + sizeof(MetaObject));
+    }
+    else
+    {
+        r.ObjectPtr = AllocOld(pHeap, iSize);
+        if (!r.ObjectPtr)
+        {
+            r.Type = OP_TYPE_NULL;
+            return r;
+        }
+        memset(r.ObjectPtr->Mem, 0, iSize * sizeof(PolyObject));
+    }
+
+    pHeap->Stats.BytesAllocated += ObjectBytes(iSize);
     r.Type = OP_TYPE_OBJECT;
-    r.ObjectPtr->marked = 0;
-    r.ObjectPtr->RefCount = 1;
-    r.ObjectPtr->NextObject = *ppPrevious;
-    r.ObjectPtr->Size = iSize;
-    r.ObjectPtr->Mem = (PolyObject *)(((char *)r.ObjectPtr) + sizeof(MetaObject));
+    return r;
+}
 
-    // 指向新分配的对象
-    *ppPrevious = r.ObjectPtr;
+// ----Minor Collection ----------------------------------------------------------------------
 
-    return r;
+// 根或字段引用新生代对象时，把对象复制到老年代(只复制一次)并改为引用副本
+void GC_Promote(GC_HEAP *pHeap, PolyObject *pVal)
+{
+    if (pVal->Type != OP_TYPE_OBJECT || !GC_IsYoung(pHeap, pVal->ObjectPtr))
+        return;
+
+    MetaObject *pYoung = pVal->ObjectPtr;
+    if (!(pYoung->Flags & GC_FORWARDED))
+    {
+        // 字段中字符串的引用随副本转移
+        MetaObject *pOld = AllocOld(pHeap, pYoung->Size);
+        if (!pOld || !PushObject(&pHeap->Promoted, pOld))
+            OutOfMemory();
+        memcpy(pOld->Mem, pYoung->Mem, pYoung->Size * sizeof(PolyObject));
+        pHeap->NurseryBytes -= ObjectBytes(pYoung->Size);
+
+        // 标记期间晋升的对象可能引用白色对象，要扫描它的字段
+        if (pHeap->Phase == GC_PHASE_MARK)
+            PushGrey(pHeap, pOld);
+
+        pYoung->Flags |= GC_FORWARDED;
+        pYoung->NextObject = pOld;
+    }
+
+    pVal->ObjectPtr = pYoung->NextObject;
+}
+
+static void PromoteFields(GC_HEAP *pHeap, MetaObject *pObject)
+{
+    for (size_t i = 0; i < pObject->Size; i++)
+        GC_Promote(pHeap, &pObject->Mem[i]);
 }
 
-// 标记对象
-void GC_Mark(PolyObject val) 
+// 把老年代对象记入记忆集，供写屏障调用
+void GC_Remember(GC_HEAP *pHeap, MetaObject *pObject)
 {
-    if (val.Type == OP_TYPE_OBJECT) 
+    if (!PushObject(&pHeap->Remembered, pObject))
+        OutOfMemory();
+    pObject->Flags |= GC_REMEMBERED;
+}
+
+// 释放新生代中没有晋升的对象字段里的字符串
+static void ReleaseYoungStrings(GC_HEAP *pHeap)
+{
+    char *p = pHeap->Nursery;
+    while (p < pHeap->NurseryTop)
     {
-        // 检查循环
-        if (val.ObjectPtr->marked)
-            return; 
+        MetaObject *pObject = (MetaObject *)p;
+        if (!(pObject->Flags & GC_FORWARDED))
+        {
+            for (size_t i = 0; i < pObject->Size; i++)
+                if (pObject->Mem[i].Type == OP_TYPE_STRING)
+                    Str_Release(pObject->Mem[i].String);
+        }
+        p += AlignedBytes(pObject->Size);
+    }
+}
 
-        val.ObjectPtr->marked = 1;
+// 调用者已经对所有根调用了GC_Promote()。晋升记忆集和已晋升对象引用的新生代对象，
+// 然后清空新生代。返回死亡的新生代对象个数
+int GC_FinishMinor(GC_HEAP *pHeap)
+{
+    int iOldCount = pHeap->ObjectCount;
 
-        // FIXME 嵌套过深会溢出
-        for (size_t i = 0; i < val.ObjectPtr->Size; i++)
-            GC_Mark(val.ObjectPtr->Mem[i]);
+    for (int i = 0; i < pHeap->Remembered.Top; i++)
+    {
+        MetaObject *pObject = pHeap->Remembered.Items[i];
+        pObject->Flags &= ~GC_REMEMBERED;
+        PromoteFields(pHeap, pObject);
     }
+    pHeap->Remembered.Top = 0;
+
+    while (pHeap->Promoted.Top > 0)
+        PromoteFields(pHeap, pHeap->Promoted.Items[--pHeap->Promoted.Top]);
+
+    int iDead = pHeap->YoungCount - (pHeap->ObjectCount - iOldCount);
+
+    if (pHeap->YoungStrings)
+        ReleaseYoungStrings(pHeap);
+
+    if (pHeap->Nursery)
+        memset(pHeap->Nursery, 0, pHeap->NurseryTop - pHeap->Nursery);
+    pHeap->NurseryTop = pHeap->Nursery;
+    pHeap->YoungCount = 0;
+    pHeap->YoungStrings = FALSE;
+
+    // 没有晋升的对象都已死亡
+    pHeap->Stats.BytesFreed += pHeap->NurseryBytes;
+    pHeap->Stats.MinorCollections++;
+    pHeap->NurseryBytes = 0;
+
+    return iDead;
+}
+
+// 释放老年代对象和字段中的字符串
+static void FreeObject(GC_HEAP *pHeap, MetaObject *object)
+{
+    for (size_t i = 0; i < object->Size; i++)
+        if (object->Mem[i].Type == OP_TYPE_STRING)
+            Str_Release(object->Mem[i].String);
+
+    pHeap->OldBytes -= ObjectBytes(object->Size);
+    pHeap->Stats.BytesFreed += ObjectBytes(object->Size);
+    FreeBlock(pHeap, object);
 }
 
-// 清除对象
-// 返回被清除的对象个数
-int GC_Sweep(MetaObject **ppObjects)
+// 标记完成，开始清除。游标指向下一个要检查的对象的链接
+void GC_StartSweep(GC_HEAP *pHeap)
 {
-    int iNumObject = 0;
-    MetaObject **ppObjectList = ppObjects;
-    while (*ppObjectList) {
-        if (!(*ppObjectList)->marked)
+    pHeap->Phase = GC_PHASE_SWEEP;
+    pHeap->SweepCursor = &pHeap->Objects;
+}
+
+// 清除至多*piWork个对象中未标记的，*piWork减去检查的个数。返回TRUE表示这一轮回收已结束
+int GC_SweepStep(GC_HEAP *pHeap, int *piWork)
+{
+    int iWork = *piWork;
+    MetaObject **ppObjectList = pHeap->SweepCursor;
+
+    // 游标所在的链接属于存活的对象(或链表头)，清除暂停期间不会失效
+    while (*ppObjectList && iWork > 0) {
+        if (!IsMarked(pHeap, *ppObjectList))
         {
-            // 删除不可达对象
+            // 删除不可达对象，回收它的编号
             MetaObject *unreached = *ppObjectList;
             *ppObjectList = unreached->NextObject;
-            free(unreached);
-            iNumObject++;
+            pHeap->FreeIds[pHeap->FreeIdCount++] = unreached->Id;
+            FreeObject(pHeap, unreached);
+            pHeap->ObjectCount--;
         }
         else
         {
-            // 重置可达对象的标记
-            (*ppObjectList)->marked = 0;
             ppObjectList = &(*ppObjectList)->NextObject;
         }
+        iWork--;
     }
 
-    return iNumObject;
-}
+    *piWork = iWork;
+    pHeap->SweepCursor = ppObjectList;
+    if (*ppObjectList)
+        return FALSE;
 
+    // 可达对象的标记一次清除，不再逐个写回对象
+    memset(pHeap->MarkBits, 0, pHeap->MarkWords * sizeof(unsigned int));
 
-void GC_FreeAllObjects(MetaObject *pObjects)
+    pHeap->Phase = GC_PHASE_IDLE;
+    pHeap->SweepCursor = NULL;
+    pHeap->Stats.LiveBytes = pHeap->OldBytes;
+    pHeap->Stats.Collections++;
+    return TRUE;
+}
+
+// 释放所有对象，堆回到初始状态，新生代、位图和各个栈保留以便重用
+void GC_FreeAllObjects(GC_HEAP *pHeap)
 {
-    MetaObject *object = pObjects;
+    if (pHeap->Nursery)
+    {
+        ReleaseYoungStrings(pHeap);
+        memset(pHeap->Nursery, 0, pHeap->NurseryTop - pHeap->Nursery);
+        pHeap->NurseryTop = pHeap->Nursery;
+    }
+    pHeap->YoungCount = 0;
+    pHeap->YoungStrings = FALSE;
+    pHeap->Remembered.Top = 0;
+    pHeap->Promoted.Top = 0;
+    pHeap->Stats.BytesFreed += pHeap->NurseryBytes;
+    pHeap->NurseryBytes = 0;
+
+    MetaObject *object = pHeap->Objects;
     while (object) {
         MetaObject *tmp = object->NextObject;
-        free(object);
+        FreeObject(pHeap, object);
         object = tmp;
     }
-}
\ No newline at end of file
+
+    pHeap->Objects = NULL;
+    pHeap->ObjectCount = 0;
+    pHeap->NextId = 0;
+    pHeap->FreeIdCount = 0;
+    pHeap->Grey.Top = 0;
+    pHeap->GreyOverflow = FALSE;
+    pHeap->Phase = GC_PHASE_IDLE;
+    pHeap->SweepCursor = NULL;
+    pHeap->Stats.LiveBytes = 0;
+    if (pHeap->MarkBits)
+        memset(pHeap->MarkBits, 0, pHeap->MarkWords * sizeof(unsigned int));
+}
+
+// 释放所有对象以及堆自身的缓冲区
+void GC_DestroyHeap(GC_HEAP *pHeap)
+{
+    GC_FreeAllObjects(pHeap);
+
+    while (pHeap->Slabs)
+    {
+        GC_SLAB *pNext = pHeap->Slabs->Next;
+        free(pHeap->Slabs);
+        pHeap->Slabs = pNext;
+    }
+
+    free(pHeap->Nursery);
+    free(pHeap->MarkBits);
+    free(pHeap->FreeIds);
+    free(pHeap->Grey.Items);
+    free(pHeap->Remembered.Items);
+    free(pHeap->Promoted.Items);
+    memset(pHeap, 0, sizeof(GC_HEAP));
+}
+
+// 按映射重定位对象引用
+void GC_RelocateValue(PolyObject *pVal, GC_RELOC_MAP &Relocs)
+{
+    if (pVal->Type == OP_TYPE_OBJECT)
+        pVal->ObjectPtr = Relocs[pVal->ObjectPtr];
+}
+
+// 按原顺序把pHeap的对象复制到空堆pClone中，对象之间的引用指向新的对象，字段中的字符串
+// 也被复制。pHeap的新生代必须是空的。Relocs返回旧对象到新对象的映射，供调用者重定位
+// 堆外的引用。内存不足时返回FALSE
+int GC_CloneObjects(GC_HEAP *pHeap, GC_HEAP *pClone, GC_RELOC_MAP &Relocs)
+{
+    assert(pHeap->YoungCount == 0);
+
+    MetaObject **ppTail = &pClone->Objects;
+    pClone->Objects = NULL;
+
+    for (MetaObject *object = pHeap->Objects; object; object = object->NextObject)
+    {
+        size_t byteCount = sizeof(MetaObject) + object->Size * sizeof(PolyObject);
+        unsigned int iId;
+        MetaObject *copy = AllocId(pClone, &iId) ? AllocBlock(pClone, object->Size) : NULL;
+        if (!copy)
+        {
+            // 已复制的对象的字段仍然引用原对象的字符串，不能释放它们
+            while (pClone->Objects)
+            {
+                MetaObject *tmp = pClone->Objects->NextObject;
+                FreeBlock(pClone, pClone->Objects);
+                pClone->Objects = tmp;
+            }
+            pClone->ObjectCount = 0;
+            pClone->OldBytes = 0;
+            pClone->Stats.BytesAllocated = 0;
+            pClone->NextId = 0;
+            return FALSE;
+        }
+
+        memcpy(copy, object, byteCount);
+        copy->Id = iId;
+        copy->Flags = 0;
+        copy->Mem = (PolyObject *)(((char *)copy) + sizeof(MetaObject));
+        copy->NextObject = NULL;
+
+        Relocs[object] = copy;
+        *ppTail = copy;
+        ppTail = &copy->NextObject;
+        pClone->ObjectCount++;
+        pClone->OldBytes += byteCount;
+        pClone->Stats.BytesAllocated += byteCount;
+    }
+    pClone->Stats.LiveBytes = pClone->OldBytes;
+
+    for (MetaObject *copy = pClone->Objects; copy; copy = copy->NextObject)
+    {
+        for (size_t i = 0; i < copy->Size; i++)
+        {
+            PolyObject *pField = &copy->Mem[i];
+            if (pField->Type == OP_TYPE_STRING)
+                pField->String = Str_Unshare(pField->String);
+            else
+                GC_RelocateValue(pField, Relocs);
+        }
+    }
+
+    return TRUE;
+}
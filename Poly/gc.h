@@ -1,13 +1,75 @@
 #ifndef __GC_H__
 #define	__GC_H__
 
+#include <unordered_map>
 #include "vm.h"
+#include "polystr.h"
+
+// 复制堆时旧对象到新对象的映射
+typedef std::unordered_map<MetaObject *, MetaObject *> GC_RELOC_MAP;
+
+// MetaObject::Flags
+#define GC_FORWARDED 1  // 新生代对象已晋升，NextObject指向老年代中的副本
+#define GC_REMEMBERED 2 // 老年代对象已在记忆集中
+
+// GC_HEAP::Phase，老年代回收所处的阶段
+#define GC_PHASE_IDLE 0  // 没有进行中的回收
+#define GC_PHASE_MARK 1  // 增量标记
+#define GC_PHASE_SWEEP 2 // 增量清除
 
 // -------- Garbage Collection Interface ----------------------
 
-PolyObject GC_AllocObject(int iSize, MetaObject **ppPrevious);
-void GC_Mark(PolyObject val);
-int GC_Sweep(MetaObject **ppObjects);
-void GC_FreeAllObjects(MetaObject *pObjects);
+PolyObject GC_AllocObject(GC_HEAP *pHeap, int iSize);
+void GC_Mark(GC_HEAP *pHeap, PolyObject val);
+void GC_Trace(GC_HEAP *pHeap);
+int GC_MarkStep(GC_HEAP *pHeap, int *piWork);
+void GC_StartSweep(GC_HEAP *pHeap);
+int GC_SweepStep(GC_HEAP *pHeap, int *piWork);
+void GC_Promote(GC_HEAP *pHeap, PolyObject *pVal);
+int GC_FinishMinor(GC_HEAP *pHeap);
+void GC_Remember(GC_HEAP *pHeap, MetaObject *pObject);
+void GC_FreeAllObjects(GC_HEAP *pHeap);
+void GC_DestroyHeap(GC_HEAP *pHeap);
+int GC_CloneObjects(GC_HEAP *pHeap, GC_HEAP *pClone, GC_RELOC_MAP &Relocs);
+void GC_RelocateValue(PolyObject *pVal, GC_RELOC_MAP &Relocs);
+
+// 对象是否在新生代中
+static inline int GC_IsYoung(GC_HEAP *pHeap, MetaObject *pObject)
+{
+    return (char *)pObject >= pHeap->Nursery && (char *)pObject < pHeap->NurseryEnd;
+}
+
+// 新生代是否还能容纳有iSize个字段的对象。太大的对象直接在老年代中分配，不受影响
+int GC_NurseryHasRoom(GC_HEAP *pHeap, int iSize);
+
+// 写对象的字段。对象的字段只能经由这里写入：老年代对象引用新生代对象时，写屏障把它
+// 记入记忆集，minor GC把它的字段当作根；增量标记期间写入的老年代对象被涂成灰色
+static inline void GC_WriteField(GC_HEAP *pHeap, MetaObject *pObject, int iIndex, PolyObject *pVal)
+{
+    PolyObject *pField = &pObject->Mem[iIndex];
+
+    if (pVal->Type == OP_TYPE_STRING)
+        Str_Retain(pVal->String);
+    if (pField->Type == OP_TYPE_STRING)
+        Str_Release(pField->String);
+    *pField = *pVal;
+
+    if (GC_IsYoung(pHeap, pObject))
+    {
+        if (pVal->Type == OP_TYPE_STRING)
+            pHeap->YoungStrings = TRUE;
+    }
+    else if (pVal->Type == OP_TYPE_OBJECT && !(pObject->Flags & GC_REMEMBERED) &&
+             GC_IsYoung(pHeap, pVal->ObjectPtr))
+    {
+        GC_Remember(pHeap, pObject);
+    }
+
+    if (pHeap->Phase == GC_PHASE_MARK && pVal->Type == OP_TYPE_OBJECT &&
+        !GC_IsYoung(pHeap, pVal->ObjectPtr))
+    {
+        GC_Mark(pHeap, *pVal);
+    }
+}
 
-#endif	/* __GC_H__ */
\ No newline at end of file
+#endif	/* __GC_H__ */
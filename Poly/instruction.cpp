@@ -1,4 +1,5 @@
 #include "instruction.h"
+#include "polystr.h"
 
 #ifdef WIN32
 #include <windows.h>
@@ -6,22 +7,16 @@
 
 void CopyValue(PolyObject *pDest, PolyObject* Source)
 {
-    // If the destination already contains a string, make sure to free it first
+    // ַǲɱģʱֻüͷţ
+    // ԴĿͬһֵʱҲǰͷ
 
-    if (pDest->Type == OP_TYPE_STRING)
-        free(pDest->String);
+    if (Source->Type == OP_TYPE_STRING)
+        Str_Retain(Source->String);
 
-    // Copy the object (shallow copy)
+    if (pDest->Type == OP_TYPE_STRING)
+        Str_Release(pDest->String);
 
     *pDest = *Source;
-
-    // Make a physical copy of the source string, if necessary
-
-    if (Source->Type == OP_TYPE_STRING)
-    {
-        pDest->String = (char *)malloc(strlen(Source->String) + 1);
-        strcpy(pDest->String, Source->String);
-    }
 }
 
 void exec_push(script_env *sc, PolyObject *Val)
@@ -32,10 +27,10 @@ void exec_push(script_env *sc, PolyObject *Val)
     sc->iTopIndex++;
 }
 
+// صֵȻջۣһѹջ֮ǰЧҪʱCopyValue()
 PolyObject exec_pop(script_env *sc)
 {
-    PolyObject Val;
-    CopyValue(&Val, &sc->stack[--sc->iTopIndex]);
+    PolyObject Val = sc->stack[--sc->iTopIndex];
     return Val;
 }
 
@@ -55,6 +50,19 @@ void exec_dup(script_env *sc)
 
 void exec_add(const PolyObject& op0, const PolyObject& op1, PolyObject& op2)
 {
+    // һַʱƴӡ´ַop2
+    if (op0.Type == OP_TYPE_STRING || op1.Type == OP_TYPE_STRING)
+    {
+        STR_BUILDER Builder;
+        Str_BuilderInit(&Builder, Str_ValueSizeHint(&op0) + Str_ValueSizeHint(&op1));
+        Str_BuilderAppendValue(&Builder, &op0);
+        Str_BuilderAppendValue(&Builder, &op1);
+
+        op2.Type = OP_TYPE_STRING;
+        op2.String = Str_BuilderFinish(&Builder);
+        return;
+    }
+
     switch (op0.Type)
     {
     case OP_TYPE_INT:
@@ -66,13 +74,59 @@ void exec_add(const PolyObject& op0, const PolyObject& op1, PolyObject& op2)
         op2.Type = OP_TYPE_FLOAT;
         op2.Realnum = op0.Realnum + op1.Realnum;
         break;
+    }
+}
 
-    case OP_TYPE_STRING:
-        op2.Type = OP_TYPE_STRING;
-        // TODO δʵ
-        //op2.Realnum = op0.Realnum + op1.Realnum;
-        break;
+// ջiCountֵ(a + b + c + ...)滻ǡ
+// ַ֮ǰԪӷ㣬 1 + 2 + "a" õ "3a"
+// ֮ĸһƴӵͬһַУֻһ
+void exec_addn(script_env *sc, int iCount)
+{
+    PolyObject *pValues = &sc->stack[sc->iTopIndex - iCount];
+    PolyObject Sum = pValues[0];
+
+    int i;
+    for (i = 1; i < iCount; ++i)
+    {
+        const PolyObject &Term = pValues[i];
+        if (Sum.Type == OP_TYPE_INT && Term.Type == OP_TYPE_INT)
+        {
+            Sum.Fixnum += Term.Fixnum;
+        }
+        else if (Sum.Type == OP_TYPE_STRING || Term.Type == OP_TYPE_STRING)
+        {
+            break;
+        }
+        else
+        {
+            PolyObject Result;
+            Result.Type = OP_TYPE_NULL;
+            exec_add(Sum, Term, Result);
+            Sum = Result;
+        }
     }
+
+    if (i < iCount)
+    {
+        int iSize = Str_ValueSizeHint(&Sum);
+        for (int j = i; j < iCount; ++j)
+            iSize += Str_ValueSizeHint(&pValues[j]);
+
+        STR_BUILDER Builder;
+        Str_BuilderInit(&Builder, iSize);
+        Str_BuilderAppendValue(&Builder, &Sum);
+        for (int j = i; j < iCount; ++j)
+            Str_BuilderAppendValue(&Builder, &pValues[j]);
+
+        Sum.Type = OP_TYPE_STRING;
+        Sum.String = Str_BuilderFinish(&Builder);
+    }
+
+    // ڵһջУַýջ
+    if (pValues[0].Type == OP_TYPE_STRING)
+        Str_Release(pValues[0].String);
+    pValues[0] = Sum;
+    sc->iTopIndex -= iCount - 1;
 }
 
 void exec_sub(const PolyObject& op0, const PolyObject& op1, PolyObject& op2)
@@ -250,8 +304,12 @@ void exec_trap(script_env *sc, int interrupt)
             printf("%d\n", op0.Fixnum);
             break;
         case OP_TYPE_FLOAT:
-            printf("%.16g\n", op0.Realnum);
+        {
+            char pstrBuffer[STR_NUMBER_SIZE];
+            Str_FormatFloat(op0.Realnum, pstrBuffer);
+            printf("%s\n", pstrBuffer);
             break;
+        }
         case OP_TYPE_STRING:
             printf("%s\n", op0.String);
             break;
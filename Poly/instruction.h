@@ -15,6 +15,7 @@ void exec_mul(const PolyObject& op0, const PolyObject& op1, PolyObject& op2);
 void exec_div(const PolyObject& op0, const PolyObject& op1, PolyObject& op2);
 void exec_mod(const PolyObject& op0, const PolyObject& op1, PolyObject& op2);
 void exec_exp(const PolyObject& op0, const PolyObject& op1, PolyObject& op2);
+void exec_addn(script_env *sc, int iCount);
 
 void exec_and(const PolyObject& op0, const PolyObject& op1, PolyObject& op2);
 void exec_or(const PolyObject& op0, const PolyObject& op1, PolyObject& op2);
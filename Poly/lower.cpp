@@ -0,0 +1,450 @@
+/* 载入时把指令流降级为连续存放的预解码指令 */
+
+#include "bytecode.h"
+#include "dispatch.h"
+
+// ----Lowering Rules ----------------------------------------------------------------------
+//
+// 降级后的指令与原指令流按索引一一对应，跳转目标和返回地址无需重定位。
+//
+//   PUSH/POP    按操作数种类改写为 *_LOCAL/*_GLOBAL/*_INDEXED/*_IMM/*_REG，操作数就地存放
+//   跳转指令    A = 目标指令索引
+//   算术指令    操作数在栈上，执行时特化(quickening)就地改写操作码，条件跳转同样如此
+//   CALL        A = 函数索引；宿主函数改写为 CALL_HOST，A = 宿主调用表索引
+//   其他指令    操作数原样复制到常量池，A/B = 常量池索引，执行时再解析
+
+// 把操作数复制到常量池，返回它的索引
+static int AddConst(CODE_STREAM *pStream, const PolyObject *pOp)
+{
+    pStream->Consts[pStream->ConstCount] = *pOp;
+    return pStream->ConstCount++;
+}
+
+static void LowerPush(CODE_STREAM *pStream, CODE *pCode, const PolyObject *pOp)
+{
+    switch (pOp->Type)
+    {
+    case OP_TYPE_ABS_STACK_INDEX:
+        // 负索引相对于栈帧
+        pCode->Opcode = pOp->StackIndex < 0 ? INSTR_PUSH_LOCAL : INSTR_PUSH_GLOBAL;
+        pCode->A = pOp->StackIndex;
+        break;
+
+    case OP_TYPE_REL_STACK_INDEX:
+        pCode->Opcode = INSTR_PUSH_INDEXED;
+        pCode->A = pOp->StackIndex;
+        pCode->B = pOp->OffsetIndex;
+        break;
+
+    case OP_TYPE_REG:
+        pCode->Opcode = INSTR_PUSH_REG;
+        break;
+
+    default:
+        pCode->Opcode = INSTR_PUSH_IMM;
+        pCode->A = AddConst(pStream, pOp);
+        break;
+    }
+}
+
+static void LowerPop(CODE_STREAM *pStream, CODE *pCode, const PolyObject *pOp)
+{
+    switch (pOp->Type)
+    {
+    case OP_TYPE_ABS_STACK_INDEX:
+        pCode->Opcode = pOp->StackIndex < 0 ? INSTR_POP_LOCAL : INSTR_POP_GLOBAL;
+        pCode->A = pOp->StackIndex;
+        break;
+
+    case OP_TYPE_REL_STACK_INDEX:
+        pCode->Opcode = INSTR_POP_INDEXED;
+        pCode->A = pOp->StackIndex;
+        pCode->B = pOp->OffsetIndex;
+        break;
+
+    case OP_TYPE_REG:
+        pCode->Opcode = INSTR_POP_REG;
+        break;
+
+    default:
+        // 不常见的目的操作数，交给通用的POP处理
+        pCode->Opcode = INSTR_POP;
+        pCode->A = AddConst(pStream, pOp);
+        break;
+    }
+}
+
+// ----Superinstructions ------------------------------------------------------------------
+//
+// 超级指令占据序列第一条指令的位置，执行后直接跳过序列的其余部分。其余指令原样保留，
+// 只有在它们都不是其他跳转的目标时才能融合。
+
+// 栈变量：局部变量或全局变量，A是栈索引(负数相对于栈帧)
+static inline int IsStackPush(const CODE *pCode)
+{
+    return pCode->Opcode == INSTR_PUSH_LOCAL || pCode->Opcode == INSTR_PUSH_GLOBAL;
+}
+
+static inline int IsStackPop(const CODE *pCode)
+{
+    return pCode->Opcode == INSTR_POP_LOCAL || pCode->Opcode == INSTR_POP_GLOBAL;
+}
+
+static inline int IsCompare(int iOpcode)
+{
+    return iOpcode >= INSTR_JE && iOpcode <= INSTR_JLE;
+}
+
+// 序列[iIndex + 1, iIndex + iCount)中没有任何跳转目标
+static int IsStraightLine(const int *pRefs, int iIndex, int iCount)
+{
+    for (int i = iIndex + 1; i < iIndex + iCount; ++i)
+        if (pRefs[i])
+            return FALSE;
+    return TRUE;
+}
+
+// 比较产生布尔值再由BRFALSE测试(ParseRelational/ParseIf/ParseWhile)：
+//
+//   i:     Jcc T
+//   i + 1: ICONST0
+//   i + 2: JMP E
+//   i + 3: ICONST1    (T)
+//   i + 4: BRFALSE X  (E)
+//
+// T和E只能被这个序列自己引用
+static int IsCompareBranch(const CODE *pCodes, const int *pRefs, int i, int iSize)
+{
+    return i + 4 < iSize &&
+           IsCompare(pCodes[i].Opcode) && pCodes[i].A == i + 3 &&
+           pCodes[i + 1].Opcode == INSTR_ICONST0 &&
+           pCodes[i + 2].Opcode == INSTR_JMP && pCodes[i + 2].A == i + 4 &&
+           pCodes[i + 3].Opcode == INSTR_ICONST1 &&
+           pCodes[i + 4].Opcode == INSTR_BRFALSE &&
+           !pRefs[i + 1] && !pRefs[i + 2] && pRefs[i + 3] == 1 && pRefs[i + 4] == 1;
+}
+
+// 尝试融合从i开始的指令序列，返回融合的指令条数，没有融合时返回0
+static int FuseAt(CODE *pCodes, const int *pRefs, int i, int iSize)
+{
+    CODE *pCode = &pCodes[i];
+
+    // PUSH S; PUSH S|I; Jcc ... BRFALSE X
+    if (i + 2 < iSize && IsStackPush(&pCodes[i]) &&
+        (IsStackPush(&pCodes[i + 1]) || pCodes[i + 1].Opcode == INSTR_PUSH_IMM) &&
+        !pRefs[i + 1] && !pRefs[i + 2] && IsCompareBranch(pCodes, pRefs, i + 2, iSize))
+    {
+        int iCond = pCodes[i + 2].Opcode - INSTR_JE;
+        int iBase = IsStackPush(&pCodes[i + 1]) ? INSTR_CMP_JE_SS : INSTR_CMP_JE_SI;
+
+        pCode->C = pCodes[i + 6].A;
+        pCode->B = pCodes[i + 1].A;
+        pCode->Opcode = iBase + iCond;
+        return 7;
+    }
+
+    // Jcc ... BRFALSE X
+    if (IsCompareBranch(pCodes, pRefs, i, iSize))
+    {
+        pCode->Opcode = INSTR_CMP_JE + (pCode->Opcode - INSTR_JE);
+        pCode->A = pCodes[i + 4].A;
+        return 5;
+    }
+
+    // PUSH S; PUSH S|I; ADD|SUB
+    if (i + 2 < iSize && IsStackPush(&pCodes[i]) &&
+        (IsStackPush(&pCodes[i + 1]) || pCodes[i + 1].Opcode == INSTR_PUSH_IMM) &&
+        (pCodes[i + 2].Opcode == INSTR_ADD || pCodes[i + 2].Opcode == INSTR_SUB) &&
+        IsStraightLine(pRefs, i, 3))
+    {
+        int iImm = (pCodes[i + 1].Opcode == INSTR_PUSH_IMM);
+        if (pCodes[i + 2].Opcode == INSTR_ADD)
+            pCode->Opcode = iImm ? INSTR_ADD_SI : INSTR_ADD_SS;
+        else
+            pCode->Opcode = iImm ? INSTR_SUB_SI : INSTR_SUB_SS;
+        pCode->B = pCodes[i + 1].A;
+        return 3;
+    }
+
+    // PUSH S|I; POP S
+    if (i + 1 < iSize && IsStackPop(&pCodes[i + 1]) &&
+        (IsStackPush(&pCodes[i]) || pCodes[i].Opcode == INSTR_PUSH_IMM) && !pRefs[i + 1])
+    {
+        pCode->Opcode = IsStackPush(&pCodes[i]) ? INSTR_MOV_SS : INSTR_MOV_SI;
+        pCode->B = pCode->A;
+        pCode->A = pCodes[i + 1].A;
+        return 2;
+    }
+
+    return 0;
+}
+
+/******************************************************************************************
+*
+*    FuseInstrs()
+*
+*    Replaces common instruction sequences of the pre-decoded code with superinstructions.
+*    Returns the number of superinstructions generated, or -1 if out of memory.
+*/
+
+static int FuseInstrs(script_env *sc)
+{
+    CODE *pCodes = sc->Code.Codes;
+    int iSize = sc->Code.Size;
+
+    // 统计每条指令被跳转和函数入口引用的次数
+    int *pRefs = (int *)calloc(iSize + 1, sizeof(int));
+    if (!pRefs)
+        return -1;
+
+    for (int i = 0; i < iSize; ++i)
+    {
+        int iOpcode = pCodes[i].Opcode;
+        if (iOpcode == INSTR_JMP || IsCompare(iOpcode) ||
+            iOpcode == INSTR_BRTRUE || iOpcode == INSTR_BRFALSE)
+            ++pRefs[pCodes[i].A];
+    }
+
+    for (int i = 0; i < sc->FuncTable.Size; ++i)
+        ++pRefs[sc->FuncTable.Funcs[i].EntryPoint];
+
+    int iFusionCount = 0;
+    for (int i = 0; i < iSize;)
+    {
+        int iCount = FuseAt(pCodes, pRefs, i, iSize);
+        if (iCount)
+        {
+            ++iFusionCount;
+            i += iCount;
+        }
+        else
+        {
+            ++i;
+        }
+    }
+
+    free(pRefs);
+    return iFusionCount;
+}
+
+static int CompareInts(const void *a, const void *b)
+{
+    int x = *(const int *)a, y = *(const int *)b;
+    return (x > y) - (x < y);
+}
+
+/******************************************************************************************
+*
+*    MeasureStackDepths()
+*
+*    Sets each function's MaxStackDepth, so a call checks for overflow once instead of
+*    every push. The depths depend only on the instruction stream, so this runs once per
+*    program on its shared function table. Returns FALSE if out of memory.
+*/
+
+int MeasureStackDepths(script_env *sc)
+{
+    INSTR *pInstrs = sc->InstrStream.Instrs;
+    int iSize = sc->InstrStream.Size;
+    FUNC *pFuncs = sc->FuncTable.Funcs;
+    int iFuncCount = sc->FuncTable.Size;
+
+    // pPushes[i]为前i条指令中压栈指令的条数。语句之间表达式栈是空的，所以循环不会
+    // 累积，函数体内压栈指令的条数就是表达式深度的上限
+    int *pPushes = (int *)malloc((iSize + 1) * sizeof(int));
+    int *pEntries = (int *)malloc((iFuncCount + 1) * sizeof(int));
+    if (!pPushes || !pEntries)
+    {
+        free(pPushes);
+        free(pEntries);
+        return FALSE;
+    }
+
+    pPushes[0] = 0;
+    for (int i = 0; i < iSize; ++i)
+    {
+        int iPush = 0;
+        switch (pInstrs[i].Opcode)
+        {
+        case INSTR_PUSH:
+        case INSTR_DUP:
+        case INSTR_ICONST0:
+        case INSTR_ICONST1:
+        case INSTR_FCONST_0:
+        case INSTR_FCONST_1:
+        case INSTR_NEW:
+            iPush = 1;
+            break;
+        }
+        pPushes[i + 1] = pPushes[i] + iPush;
+    }
+
+    // 函数体从入口一直延伸到下一个函数的入口
+    for (int i = 0; i < iFuncCount; ++i)
+        pEntries[i] = pFuncs[i].EntryPoint;
+    pEntries[iFuncCount] = iSize;
+    qsort(pEntries, iFuncCount + 1, sizeof(int), CompareInts);
+
+    for (int i = 0; i < iFuncCount; ++i)
+    {
+        int iEntry = pFuncs[i].EntryPoint;
+        int *pNext = (int *)bsearch(&iEntry, pEntries, iFuncCount + 1, sizeof(int), CompareInts);
+        while (pNext < pEntries + iFuncCount && *pNext <= iEntry)
+            ++pNext;
+
+        int iEnd = *pNext > iSize ? iSize : *pNext;
+        int iExprDepth = iEntry < iEnd ? pPushes[iEnd] - pPushes[iEntry] : 0;
+
+        // 返回地址 + 局部数据 + 函数信息块 + 表达式
+        pFuncs[i].MaxStackDepth = 1 + pFuncs[i].LocalDataSize + 1 + iExprDepth;
+    }
+
+    free(pPushes);
+    free(pEntries);
+    return TRUE;
+}
+
+/******************************************************************************************
+*
+*    LowerInstrStream()
+*
+*    Lowers the instruction stream of the loaded script into sc->Code, a contiguous array
+*    of pre-decoded instructions whose operand kinds are resolved into the opcode, then
+*    fuses superinstructions unless sc->Fusion is off. The instruction stream and function
+*    table are only read, so a script can lower its program into buffers of its own.
+*    Lowering again reuses the buffers. Returns FALSE if out of memory.
+*/
+
+int LowerInstrStream(script_env *sc)
+{
+    CODE_STREAM *pStream = &sc->Code;
+    INSTR *pInstrs = sc->InstrStream.Instrs;
+    int iSize = sc->InstrStream.Size;
+
+    // 指令流不会改变，再次降级时缓冲区的大小与上次相同
+    if (pStream->Codes)
+    {
+        memset(pStream->Codes, 0, (iSize + 1) * sizeof(CODE));
+    }
+    else
+    {
+        // 常量池最多容纳全部操作数
+        int iOpCount = 0;
+        for (int i = 0; i < iSize; ++i)
+            iOpCount += pInstrs[i].OpCount;
+
+        pStream->Codes = (CODE *)calloc(iSize + 1, sizeof(CODE));
+        pStream->Consts = (PolyObject *)malloc((iOpCount + 1) * sizeof(PolyObject));
+        if (!pStream->Codes || !pStream->Consts)
+        {
+            FreeCodeStream(sc);
+            return FALSE;
+        }
+    }
+
+    pStream->Size = iSize;
+    pStream->ConstCount = 0;
+    pStream->FusionCount = 0;
+
+    for (int i = 0; i < iSize; ++i)
+    {
+        INSTR *pInstr = &pInstrs[i];
+        CODE *pCode = &pStream->Codes[i];
+        PolyObject *pOpList = pInstr->pOpList;
+
+        pCode->Opcode = pInstr->Opcode;
+
+        switch (pInstr->Opcode)
+        {
+        case INSTR_PUSH:
+            LowerPush(pStream, pCode, &pOpList[0]);
+            break;
+
+        case INSTR_POP:
+            LowerPop(pStream, pCode, &pOpList[0]);
+            break;
+
+        case INSTR_JMP:
+        case INSTR_JE:
+        case INSTR_JNE:
+        case INSTR_JG:
+        case INSTR_JL:
+        case INSTR_JGE:
+        case INSTR_JLE:
+        case INSTR_BRTRUE:
+        case INSTR_BRFALSE:
+            pCode->A = pOpList[0].InstrIndex;
+            break;
+
+        case INSTR_ADD:
+        case INSTR_SUB:
+        case INSTR_MUL:
+        case INSTR_DIV:
+        case INSTR_MOD:
+            // 操作数在栈上
+            break;
+
+        case INSTR_ADDN:
+            pCode->A = pOpList[0].Fixnum; // 相加的项数
+            break;
+
+        case INSTR_CALL:
+            if (pOpList[0].Type == OP_TYPE_HOST_CALL_INDEX)
+            {
+                pCode->Opcode = INSTR_CALL_HOST;
+                pCode->A = pOpList[0].HostFuncIndex;
+                pCode->B = pOpList[0].OffsetIndex; // 实参个数
+            }
+            else
+            {
+                pCode->A = pOpList[0].FuncIndex;
+            }
+            break;
+
+        default:
+            if (pInstr->OpCount > 0)
+                pCode->A = AddConst(pStream, &pOpList[0]);
+            if (pInstr->OpCount > 1)
+                pCode->B = AddConst(pStream, &pOpList[1]);
+            break;
+        }
+    }
+
+    // 与指令流一样以INSTR_HALT结尾
+    pStream->Codes[iSize].Opcode = INSTR_HALT;
+
+    if (sc->Fusion)
+    {
+        int iFusionCount = FuseInstrs(sc);
+        if (iFusionCount < 0)
+        {
+            FreeCodeStream(sc);
+            return FALSE;
+        }
+        pStream->FusionCount = iFusionCount;
+    }
+
+    return TRUE;
+}
+
+/******************************************************************************************
+*
+*    FreeCodeStream()
+*
+*    Frees the pre-decoded instructions. String constants are owned by the instruction
+*    stream and are not freed here.
+*/
+
+void FreeCodeStream(script_env *sc)
+{
+    if (sc->Code.Codes)
+        free(sc->Code.Codes);
+    if (sc->Code.Consts)
+        free(sc->Code.Consts);
+
+    sc->Code.Codes = NULL;
+    sc->Code.Consts = NULL;
+    sc->Code.Size = 0;
+    sc->Code.ConstCount = 0;
+    sc->Code.FusionCount = 0;
+}
@@ -46,18 +46,14 @@ static void poly_pause(script_env *sc)
     Poly_ReturnFromHost(sc);
 }
 
-static void h_PrintString(script_env *sc)
+static void h_PrintString(const char *str)
 {
-    char* str = Poly_GetParamAsString(sc, 0);
     puts(str);
-    Poly_ReturnFromHost(sc);
 }
 
-static void h_PrintInt(script_env *sc)
+static void h_PrintInt(int i)
 {
-    int i = Poly_GetParamAsInt(sc, 0);
     printf("Explode %d!\n", i);
-    Poly_ReturnFromHost(sc);
 }
 
 static void h_Division(script_env *sc)
@@ -68,6 +64,198 @@ static void h_Division(script_env *sc)
     Poly_ReturnFromHost(sc);
 }
 
+/* 两个字段的对象(表头, 表尾)，用来在脚本中构造链表 */
+static void h_Cons(script_env *sc)
+{
+    // 分配可能移动实参引用的对象，分配之后再读取实参
+    PolyObject Pair = Poly_NewObject(sc, 2);
+    Poly_SetObjectField(sc, Pair, 0, Poly_GetParam(sc, 1));
+    Poly_SetObjectField(sc, Pair, 1, Poly_GetParam(sc, 0));
+    Poly_ReturnObjectFromHost(sc, Pair);
+}
+
+static void h_Head(script_env *sc)
+{
+    Poly_ReturnObjectFromHost(sc, Poly_GetObjectField(sc, Poly_GetParam(sc, 0), 0));
+}
+
+static void h_Tail(script_env *sc)
+{
+    Poly_ReturnObjectFromHost(sc, Poly_GetObjectField(sc, Poly_GetParam(sc, 0), 1));
+}
+
+static void h_SetHead(script_env *sc)
+{
+    Poly_SetObjectField(sc, Poly_GetParam(sc, 1), 0, Poly_GetParam(sc, 0));
+    Poly_ReturnFromHost(sc);
+}
+
+static void h_SetTail(script_env *sc)
+{
+    Poly_SetObjectField(sc, Poly_GetParam(sc, 1), 1, Poly_GetParam(sc, 0));
+    Poly_ReturnFromHost(sc);
+}
+
+/* 参数是否是对象，链表以非对象的值结尾 */
+static void h_IsObject(script_env *sc)
+{
+    Poly_ReturnIntFromHost(sc, Poly_GetParam(sc, 0).Type == POLY_TYPE_OBJECT);
+}
+
+/* 推进老年代的回收，返回1表示没有进行中的回收 */
+static void h_GCStep(script_env *sc)
+{
+    Poly_ReturnIntFromHost(sc, Poly_GCStep(sc, Poly_GetParamAsInt(sc, 0)));
+}
+
+/* 老年代和新生代中对象的字节数，以KB为单位 */
+static void h_GCHeapKBytes(script_env *sc)
+{
+    POLY_GC_STATS Stats;
+    Poly_GetGCStats(sc, &Stats);
+    Poly_ReturnIntFromHost(sc, (int)(Stats.HeapBytes / 1024));
+}
+
+static void RegisterHostAPIs()
+{
+    Poly_RegisterHostFunc(POLY_GLOBAL_FUNC, "Average", average);
+    Poly_RegisterHostFuncI_V(POLY_GLOBAL_FUNC, "Explode", h_PrintInt);
+    Poly_RegisterHostFunc(POLY_GLOBAL_FUNC, "pause", poly_pause);
+    Poly_RegisterHostFunc(POLY_GLOBAL_FUNC, "Division", h_Division);
+    Poly_RegisterHostFuncS_V(POLY_GLOBAL_FUNC, "PrintString", h_PrintString);
+    Poly_RegisterHostFunc(POLY_GLOBAL_FUNC, "Cons", h_Cons);
+    Poly_RegisterHostFunc(POLY_GLOBAL_FUNC, "Head", h_Head);
+    Poly_RegisterHostFunc(POLY_GLOBAL_FUNC, "Tail", h_Tail);
+    Poly_RegisterHostFunc(POLY_GLOBAL_FUNC, "SetHead", h_SetHead);
+    Poly_RegisterHostFunc(POLY_GLOBAL_FUNC, "SetTail", h_SetTail);
+    Poly_RegisterHostFunc(POLY_GLOBAL_FUNC, "IsObject", h_IsObject);
+    Poly_RegisterHostFunc(POLY_GLOBAL_FUNC, "GCStep", h_GCStep);
+    Poly_RegisterHostFunc(POLY_GLOBAL_FUNC, "GCHeapKBytes", h_GCHeapKBytes);
+}
+
+// ---- Benchmark -----------------------------------------------------------------------------------
+
+/* 用每种分发引擎重复运行脚本，报告每秒执行的指令数 */
+static int BenchScript(char* pstrFilename, int iRuns)
+{
+    static const struct
+    {
+        int iEngine;
+        int iFusion;
+        const char *pstrName;
+    } Engines[] = {
+        { POLY_ENGINE_SWITCH, FALSE, "switch" },
+        { POLY_ENGINE_THREADED, FALSE, "threaded" },
+        { POLY_ENGINE_THREADED, TRUE, "fused" },
+    };
+
+    script_env *sc = Poly_Initialize();
+
+    RegisterHostAPIs();
+
+    if (Poly_LoadScript(sc, pstrFilename) != POLY_LOAD_OK)
+    {
+        printf("载入脚本失败\n");
+        exit(1);
+    }
+
+    printf("%s, %d run(s)\n", pstrFilename, iRuns);
+    printf("%-10s %16s %10s %12s\n", "engine", "instructions", "seconds", "Minstr/s");
+
+    for (size_t i = 0; i < sizeof(Engines) / sizeof(Engines[0]); ++i)
+    {
+        Poly_SetEngine(sc, Engines[i].iEngine);
+        Poly_SetFusion(sc, Engines[i].iFusion);
+
+        unsigned long long iInstrCount = Poly_GetInstrCount(sc);
+        unsigned long start = GetCurrTime();
+
+        for (int iRun = 0; iRun < iRuns; ++iRun)
+        {
+            Poly_ResetInterp(sc);
+            Poly_RunScript(sc, POLY_INFINITE_TIMESLICE);
+        }
+
+        double fSeconds = (GetCurrTime() - start) / 1000.0;
+        iInstrCount = Poly_GetInstrCount(sc) - iInstrCount;
+
+        printf("%-10s %16llu %10.3f %12.2f\n", Engines[i].pstrName, iInstrCount, fSeconds,
+               fSeconds > 0 ? iInstrCount / fSeconds / 1e6 : 0.0);
+    }
+
+    printf("%d superinstruction(s) fused\n", Poly_GetFusionCount(sc));
+
+    int iExitCode = Poly_GetExitCode(sc);
+
+    Poly_ShutDown(sc);
+
+    return iExitCode;
+}
+
+/* 用1, 2, 4 ... N个工作线程并行运行同一个脚本的多个实例，报告吞吐量 */
+static void ScaleScript(char* pstrFilename, int iInstances)
+{
+    RegisterHostAPIs();
+
+    script_env **ppScripts = (script_env **)calloc(iInstances, sizeof(script_env *));
+    for (int i = 0; i < iInstances; ++i)
+    {
+        ppScripts[i] = Poly_Initialize();
+        if (Poly_LoadScript(ppScripts[i], pstrFilename) != POLY_LOAD_OK)
+        {
+            printf("载入脚本失败\n");
+            exit(1);
+        }
+    }
+
+    poly_executor *ex = Poly_CreateExecutor(0);
+    int iMaxThreads = Poly_GetExecutorThreadCount(ex);
+    Poly_DestroyExecutor(ex);
+
+    printf("%s, %d instance(s)\n", pstrFilename, iInstances);
+    printf("%-8s %16s %10s %12s %8s\n", "threads", "instructions", "seconds", "Minstr/s", "speedup");
+
+    double fBase = 0.0;
+
+    for (int iThreads = 1;; iThreads = iThreads * 2 < iMaxThreads ? iThreads * 2 : iMaxThreads)
+    {
+        ex = Poly_CreateExecutor(iThreads);
+
+        unsigned long long iInstrCount = 0;
+        for (int i = 0; i < iInstances; ++i)
+        {
+            Poly_ResetInterp(ppScripts[i]);
+            iInstrCount -= Poly_GetInstrCount(ppScripts[i]);
+        }
+
+        unsigned long start = GetCurrTime();
+
+        // 暂停的脚本会返回，直到所有实例都运行结束
+        while (Poly_ExecutorRun(ex, ppScripts, iInstances, 0) > 0)
+            ;
+
+        double fSeconds = (GetCurrTime() - start) / 1000.0;
+        for (int i = 0; i < iInstances; ++i)
+            iInstrCount += Poly_GetInstrCount(ppScripts[i]);
+
+        double fRate = fSeconds > 0 ? iInstrCount / fSeconds / 1e6 : 0.0;
+        if (iThreads == 1)
+            fBase = fRate;
+
+        printf("%-8d %16llu %10.3f %12.2f %8.2f\n", iThreads, iInstrCount, fSeconds, fRate,
+               fBase > 0 ? fRate / fBase : 0.0);
+
+        Poly_DestroyExecutor(ex);
+
+        if (iThreads == iMaxThreads)
+            break;
+    }
+
+    for (int i = 0; i < iInstances; ++i)
+        Poly_ShutDown(ppScripts[i]);
+    free(ppScripts);
+}
+
 // ---- Entry Main ----------------------------------------------------------------------------------
 
 int RunScript(char* pstrFilename)
@@ -76,11 +264,7 @@ int RunScript(char* pstrFilename)
     script_env *sc = Poly_Initialize();
 
     // 注册宿主api
-    Poly_RegisterHostFunc(POLY_GLOBAL_FUNC, "Average", average);
-    Poly_RegisterHostFunc(POLY_GLOBAL_FUNC, "Explode", h_PrintInt);
-    Poly_RegisterHostFunc(POLY_GLOBAL_FUNC, "pause", poly_pause);
-    Poly_RegisterHostFunc(POLY_GLOBAL_FUNC, "Division", h_Division);
-    Poly_RegisterHostFunc(POLY_GLOBAL_FUNC, "PrintString", h_PrintString);
+    RegisterHostAPIs();
 
     // Load the demo script
     int iErrorCode = Poly_LoadScript(sc, pstrFilename);
@@ -95,8 +279,18 @@ int RunScript(char* pstrFilename)
     unsigned long start = GetCurrTime();
 
     // Run we're loaded script from Main()
+    // 脚本暂停时会返回到这里，睡眠到它的唤醒时刻再继续运行
+
+    for (;;)
+    {
+        Poly_RunScript(sc, POLY_INFINITE_TIMESLICE);
+        if (Poly_IsScriptStop(sc))
+            break;
 
-    Poly_RunScript(sc, POLY_INFINITE_TIMESLICE);
+        int iDur = Poly_GetNextWakeTime(sc) - Poly_GetCurrTime();
+        if (iDur > 0)
+            Sleep(iDur);
+    }
 
     printf("耗时 %fs\n", (GetCurrTime() - start) / 1000.0);
 
@@ -115,5 +309,27 @@ int main(int argc, char* argv[])
         exit(0);
     }
 
-    RunScript(argv[1]);
+    // poly -bench <script> [runs]
+    if (strcmp(argv[1], "-bench") == 0)
+    {
+        if (argc < 3) {
+            printf("%s: no input files\n", argv[0]);
+            exit(0);
+        }
+        BenchScript(argv[2], argc > 3 ? atoi(argv[3]) : 5);
+        return 0;
+    }
+
+    // poly -scale <script> [instances]
+    if (strcmp(argv[1], "-scale") == 0)
+    {
+        if (argc < 3) {
+            printf("%s: no input files\n", argv[0]);
+            exit(0);
+        }
+        ScaleScript(argv[2], argc > 3 ? atoi(argv[3]) : 64);
+        return 0;
+    }
+
+    return RunScript(argv[1]);
 }
@@ -877,6 +877,10 @@ void InitInstrTable()
     // Exp Destination, Source
     iInstrIndex = AddInstrLookup("Exp", INSTR_EXP, 0);
 
+    // AddN Count
+    iInstrIndex = AddInstrLookup("AddN", INSTR_ADDN, 1);
+    SetOpType(iInstrIndex, 0, OP_FLAG_TYPE_INT);
+
     // ----- 一元运算符
 
     // Sqrt    Destination
@@ -20,6 +20,8 @@
 #endif
 #endif
 
+#include <stddef.h>
+
 #ifdef __cplusplus
 extern "C"
 {
@@ -53,6 +55,28 @@ extern "C"
 
 #define POLY_INFINITE_TIMESLICE 1 // Allows a thread to run indefinitely
 
+    // ----Dispatch Engines ------------------------------------------------------------------
+
+#define POLY_ENGINE_SWITCH 0   // 经典的switch分发循环
+#define POLY_ENGINE_THREADED 1 // 直接线索化分发(缺省)
+
+    // ----Priorities ------------------------------------------------------------------------
+
+#define POLY_PRIORITY_NONE 0 // 未指定，按中优先级调度
+#define POLY_PRIORITY_USER 1 // 用户定义的优先级
+#define POLY_PRIORITY_LOW 2  // Low priority
+#define POLY_PRIORITY_MED 3  // Medium priority
+#define POLY_PRIORITY_HIGH 4 // High priority
+
+    // ----Value Types -----------------------------------------------------------------------
+
+    // PolyObject::Type的取值，与虚拟机内部的OP_TYPE_*相同
+#define POLY_TYPE_NULL -1   // 空值
+#define POLY_TYPE_INT 0     // 整数
+#define POLY_TYPE_FLOAT 1   // 浮点数
+#define POLY_TYPE_STRING 2  // 字符串
+#define POLY_TYPE_OBJECT 10 // 对象引用
+
     // ----The Host API ----------------------------------------------------------------------
 
 #define POLY_GLOBAL_FUNC 0 // Flags a host API function as being global
@@ -65,15 +89,55 @@ extern "C"
     // ----Data Structures -----------------------------------------------------------------------
 
     struct script_env;
+    struct poly_program;
+    struct poly_scheduler;
+    struct poly_executor;
     typedef void (*POLY_HOST_FUNCTION)(script_env *); // Host API function pointer alias
 
+    // 脚本函数句柄，由Poly_GetFuncHandle()返回。句柄在Poly_ResetInterp()之后仍然有效，
+    // 并且适用于同一个程序的所有实例
+    typedef int POLY_FUNC_HANDLE;
+#define POLY_INVALID_FUNC_HANDLE -1
+
+    // 借用的字符串：Chars指向别人拥有的字符，Length是字符个数(Chars[Length]总是'\0')。
+    // 由虚拟机返回的视图在各个函数说明的期限内有效，宿主不能修改或释放
+    typedef struct
+    {
+        const char *Chars;
+        size_t Length;
+    } POLY_STRING_VIEW;
+
+    // 垃圾回收的统计，由Poly_GetGCStats()填写。字节数是对象头和字段的大小，不包括
+    // 字段引用的字符串
+    typedef struct
+    {
+        unsigned long long Collections;      // 完成的老年代回收次数
+        unsigned long long MinorCollections; // 新生代回收次数
+        unsigned long long BytesAllocated;   // 累计分配的字节数
+        unsigned long long BytesFreed;       // 累计回收的字节数
+        size_t LiveBytes;                    // 上一轮老年代回收后存活的字节数
+        size_t HeapBytes;                    // 现有对象的字节数，包括尚未回收的
+        unsigned long long Pauses;           // 回收打断脚本的次数
+        unsigned long long TotalPauseUs;     // 所有暂停的总时间(微秒)
+        unsigned int MaxPauseUs;             // 最长的一次暂停(微秒)
+    } POLY_GC_STATS;
+
     // ----Runtime Value ---------------------------------------------------------------------
 
+    // 定义POLY_COMPACT_VALUES时，Type和OffsetIndex共用一个32位的字，32位平台上每个值
+    // 只占8个字节(缺省12个，x64上是16和24个)，栈和对象字段的访存量相应减少。
+    // 这时OffsetIndex只有24位，栈的大小不能超过2^23个值。宿主必须用相同的设置编译
+
     struct MetaObject;
 
     struct PolyObject
     {
+#ifdef POLY_COMPACT_VALUES
+        int Type : 8;         // The type
+        int OffsetIndex : 24; // 见下面OffsetIndex的说明
+#else
         int Type; // The type
+#endif
         union     // The value
         {
             MetaObject *ObjectPtr; // Object Reference
@@ -90,7 +154,10 @@ extern "C"
         // 对于OP_TYPE_REL_STACK_INDEX，该字段保存的是偏移值的地址(偏移值是一个变量)
         // 例如 var1[var2], 则该字段保存的就是var2的地址
         // 对于OP_TYPE_FUNC_INDEX，该字段保存了调用者(caller)的栈帧索引(FP)
+        // 对于OP_TYPE_HOST_CALL_INDEX，该字段保存了调用时压栈的实参个数
+#ifndef POLY_COMPACT_VALUES
         int OffsetIndex; // Index of the offset
+#endif
     };
 
     // ----Function Prototypes -------------------------------------------------------------------
@@ -104,38 +171,136 @@ extern "C"
     POLY_API int Poly_LoadScript(script_env *sc, const char *pstrFilename);
     POLY_API void Poly_UnloadScript(script_env *sc);
     POLY_API void Poly_ResetInterp(script_env *sc);
+    POLY_API poly_program *Poly_LoadProgram(const char *pstrFilename); // 只编译一次，由多个实例共享
+    POLY_API void Poly_RetainProgram(poly_program *prog);
+    POLY_API void Poly_ReleaseProgram(poly_program *prog);
+    POLY_API script_env *Poly_CreateInstance(poly_program *prog);      // 共享程序的轻量实例
+    POLY_API poly_program *Poly_GetProgram(script_env *sc);
+    POLY_API script_env *Poly_CloneScript(script_env *sc);              // 复制实例的当前状态，共享代码
     POLY_API void Poly_RunScript(script_env *sc, int iTimesliceDur);
+    POLY_API void Poly_RunScriptInstructions(script_env *sc, int iInstrBudget); // 执行固定条数的指令
     POLY_API void Poly_StartScript(script_env *sc);
     POLY_API void Poly_StopScript(script_env *sc);
     POLY_API void Poly_PauseScript(script_env *sc, int iDur);
     POLY_API void Poly_ResumeScript(script_env *sc);
+    POLY_API int Poly_GetNextWakeTime(script_env *sc); // 暂停的脚本希望再次运行的时刻
+    POLY_API int Poly_GetCurrTime();                   // 虚拟机时钟(毫秒)
     POLY_API void Poly_PassIntParam(script_env *sc, int iInt);
     POLY_API void Poly_PassFloatParam(script_env *sc, float fFloat);
     POLY_API void Poly_PassStringParam(script_env *sc, const char *pstrString);
+    POLY_API void Poly_PassStringView(script_env *sc, const char *pstrChars, size_t iLength); // 不必以'\0'结尾
+    POLY_API void Poly_PassStaticString(script_env *sc, const char *pstrStatic);             // 不复制
     POLY_API int Poly_CallScriptFunc(script_env *sc, const char *pstrName);
     POLY_API void Poly_CallScriptFuncSync(script_env *sc, const char *pstrName);
+    POLY_API POLY_FUNC_HANDLE Poly_GetFuncHandle(script_env *sc, const char *pstrName);
+    POLY_API int Poly_CallScriptFuncByHandle(script_env *sc, POLY_FUNC_HANDLE hFunc);
+    POLY_API void Poly_CallScriptFuncSyncByHandle(script_env *sc, POLY_FUNC_HANDLE hFunc);
+    POLY_API int Poly_CallScriptFuncBatch(script_env *sc, POLY_FUNC_HANDLE hFunc, const PolyObject *pArgs,
+                                          int iArgCount, int iCount, PolyObject *pResults);
+    // 批量调用返回的字符串是脚本字符串的引用，不复制。用完后在运行该脚本的线程上释放
+    POLY_API POLY_STRING_VIEW Poly_GetResultAsStringView(const PolyObject *pResult);
+    POLY_API void Poly_ReleaseResults(PolyObject *pResults, int iCount);
     POLY_API int Poly_GetReturnValueAsInt(script_env *sc);
     POLY_API float Poly_GetReturnValueAsFloat(script_env *sc);
     POLY_API char *Poly_GetReturnValueAsString(script_env *sc);
+    POLY_API POLY_STRING_VIEW Poly_GetReturnValueAsStringView(script_env *sc);
+
+    // ----Static Strings --------------------------------------------------------------------
+
+    // 宿主拥有的字符串，例如本地化文本表。创建时复制一次，之后用Poly_PassStaticString()
+    // 和Poly_ReturnStaticStringFromHost()交给脚本时只传递指针，脚本之间共享，也可以跨线程。
+    // 宿主在没有脚本再引用它(脚本结束或被重置)之后才能用Poly_FreeStaticString()释放
+    POLY_API const char *Poly_CreateStaticString(const char *pstrChars, size_t iLength);
+    POLY_API void Poly_FreeStaticString(const char *pstrStatic);
 
     // ----Host API Interface ----------------------------------------------------------------
 
     POLY_API int Poly_RegisterHostFunc(script_env *sc, const char *pstrName, POLY_HOST_FUNCTION fnFunc);
     POLY_API int Poly_GetParamAsInt(script_env *sc, int iParamIndex);
     POLY_API float Poly_GetParamAsFloat(script_env *sc, int iParamIndex);
-    POLY_API char *Poly_GetParamAsString(script_env *sc, int iParamIndex);
+    POLY_API char *Poly_GetParamAsString(script_env *sc, int iParamIndex); // 宿主函数返回前有效，不要释放
+    POLY_API POLY_STRING_VIEW Poly_GetParamAsStringView(script_env *sc, int iParamIndex); // 同上
     POLY_API PolyObject Poly_GetParam(script_env *sc, int iParamIndex);
 
     POLY_API void Poly_ReturnFromHost(script_env *sc);
     POLY_API void Poly_ReturnIntFromHost(script_env *sc, int iInt);
     POLY_API void Poly_ReturnFloatFromHost(script_env *sc, float iFloat);
-    POLY_API void Poly_ReturnStringFromHost(script_env *sc, char *pstrString);
+    POLY_API void Poly_ReturnStringFromHost(script_env *sc, const char *pstrString);
+    POLY_API void Poly_ReturnStringViewFromHost(script_env *sc, const char *pstrChars, size_t iLength);
+    POLY_API void Poly_ReturnStaticStringFromHost(script_env *sc, const char *pstrStatic);
 
     POLY_API int Poly_GetParamCount(script_env *sc); // 获取传递给函数的参数个数
+
+    // 有类型的宿主函数：虚拟机直接把实参转换成C类型传给函数，再把返回值写入_RetVal，
+    // 不必逐个调用Poly_GetParam*()和Poly_Return*FromHost()。函数名中下划线之前是参数类型，
+    // 之后是返回类型：I = int，F = float，S = const char *，V = 无返回值。参数按脚本中的
+    // 顺序传入，字符串参数不会为NULL，只在调用期间有效。实参个数不符时脚本出错退出
+    POLY_API int Poly_RegisterHostFuncI_V(script_env *sc, const char *pstrName, void (*fnFunc)(int));
+    POLY_API int Poly_RegisterHostFuncS_V(script_env *sc, const char *pstrName, void (*fnFunc)(const char *));
+    POLY_API int Poly_RegisterHostFuncI_I(script_env *sc, const char *pstrName, int (*fnFunc)(int));
+    POLY_API int Poly_RegisterHostFuncII_I(script_env *sc, const char *pstrName, int (*fnFunc)(int, int));
+    POLY_API int Poly_RegisterHostFuncIII_I(script_env *sc, const char *pstrName, int (*fnFunc)(int, int, int));
+    POLY_API int Poly_RegisterHostFuncS_I(script_env *sc, const char *pstrName, int (*fnFunc)(const char *));
+    POLY_API int Poly_RegisterHostFuncF_F(script_env *sc, const char *pstrName, float (*fnFunc)(float));
+    POLY_API int Poly_RegisterHostFuncFF_F(script_env *sc, const char *pstrName, float (*fnFunc)(float, float));
     POLY_API int Poly_IsScriptStop(script_env *sc);  // 脚本是否已经停止
     POLY_API int Poly_GetExitCode(script_env *sc);   // 脚本退出代码
     POLY_API time_t Poly_GetSourceTimestamp(const char *filename);
 
+    // ----Dispatch Interface ----------------------------------------------------------------
+
+    POLY_API void Poly_SetEngine(script_env *sc, int iEngine);       // 选择指令分发引擎
+    POLY_API unsigned long long Poly_GetInstrCount(script_env *sc); // 已执行的指令条数
+    POLY_API void Poly_SetFusion(script_env *sc, int iEnable);      // 开关超级指令融合
+    POLY_API int Poly_GetFusionCount(script_env *sc);               // 融合生成的超级指令条数
+
+    // ----Garbage Collection Interface ------------------------------------------------------
+
+    // 老年代的回收是增量的：老年代的字节数达到临界值时开始，之后脚本每分配一定字节推进
+    // 一小步，宿主也可以在空闲时间推进它，避免在一帧之内完成整个回收。每轮回收后临界值
+    // 设为存活字节数的iGrowthPercent%，但不小于iMinThreshold字节
+    POLY_API int Poly_GCStep(script_env *sc, int iMicroseconds);         // 返回TRUE表示没有进行中的回收
+    POLY_API void Poly_SetGCTimeslice(script_env *sc, int iMicroseconds); // 每次运行脚本后推进回收的时间
+    POLY_API void Poly_SetGCParams(script_env *sc, int iGrowthPercent, size_t iMinThreshold); // 0表示缺省值
+    POLY_API void Poly_GetGCStats(script_env *sc, POLY_GC_STATS *pStats);
+
+    // ----Object Interface ------------------------------------------------------------------
+
+    // 宿主函数创建和修改脚本对象。分配可能移动新生代对象，之前取得的对象值随之作废，
+    // 要重新用Poly_GetParam()或从字段中读取。字段只能用Poly_SetObjectField()写入
+    POLY_API PolyObject Poly_NewObject(script_env *sc, int iFieldCount);
+    POLY_API PolyObject Poly_GetObjectField(script_env *sc, PolyObject Object, int iFieldIndex);
+    POLY_API int Poly_SetObjectField(script_env *sc, PolyObject Object, int iFieldIndex, PolyObject Value);
+    POLY_API void Poly_ReturnObjectFromHost(script_env *sc, PolyObject Object);
+
+    // ----Scheduler Interface ---------------------------------------------------------------
+
+    POLY_API void Poly_SetPriority(script_env *sc, int iPriorityType, int iUserPriority);
+    POLY_API poly_scheduler *Poly_CreateScheduler(int iQuantum);
+    POLY_API void Poly_DestroyScheduler(poly_scheduler *sched);
+    POLY_API int Poly_SchedulerAdd(poly_scheduler *sched, script_env *sc);
+    POLY_API int Poly_SchedulerRemove(poly_scheduler *sched, script_env *sc);
+    POLY_API int Poly_SchedulerTick(poly_scheduler *sched); // 运行一轮，返回尚未结束的脚本个数
+
+    // ----Executor Interface ----------------------------------------------------------------
+    //
+    // 线程安全约定：
+    //   - 一个script_env同一时刻只能由一个线程使用，不同的script_env可以在不同的线程上并行运行
+    //   - 共享同一个poly_program的实例也可以并行运行。特化(quickening)会改写共享代码中的
+    //     操作码，读写都是relaxed原子操作，写入的总是同一条指令的有效版本
+    //   - Poly_SetFusion()只影响调用它的实例：设置与程序不同时降级到实例自己的缓冲区，
+    //     不修改共享的程序
+    //   - Poly_LoadScript()可以在任意线程上调用，编译过程在内部串行执行
+    //   - 全局宿主函数(POLY_GLOBAL_FUNC)必须在任何脚本开始运行之前注册完毕，之后不能再注册或修改
+    //   - 脚本特定的宿主函数只能由当前使用该脚本的线程注册
+    //   - 宿主函数在运行脚本的工作线程上调用，访问宿主自己的共享数据时需要自行加锁
+    //   - poly_scheduler和poly_executor本身只能在一个线程上使用
+
+    POLY_API poly_executor *Poly_CreateExecutor(int iThreads); // iThreads <= 0 时每个硬件线程一个
+    POLY_API void Poly_DestroyExecutor(poly_executor *ex);
+    POLY_API int Poly_GetExecutorThreadCount(poly_executor *ex);
+    POLY_API int Poly_ExecutorRun(poly_executor *ex, script_env **ppScripts, int iCount, int iInstrBudget);
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,395 @@
+/* 引用计数的不可变字符串 */
+
+#include <float.h>
+#include "polystr.h"
+
+// FNV-1a
+static unsigned int HashChars(const char *pstrChars, int iLength)
+{
+    unsigned int uHash = 2166136261u;
+    for (int i = 0; i < iLength; ++i)
+    {
+        uHash ^= (unsigned char)pstrChars[i];
+        uHash *= 16777619u;
+    }
+    return uHash;
+}
+
+// 分配(或扩大)能容纳iCapacity个字符的字符串
+static POLY_STRING *AllocString(POLY_STRING *pString, int iCapacity)
+{
+    pString = (POLY_STRING *)realloc(pString, offsetof(POLY_STRING, Chars) + iCapacity + 1);
+    if (!pString)
+    {
+        fprintf(stderr, "VM: 内存不足\n");
+        exit(1);
+    }
+    return pString;
+}
+
+/******************************************************************************************
+*
+*    Str_New()
+*
+*    Creates a string from iLength characters with a reference count of one.
+*/
+
+char *Str_New(const char *pstrChars, int iLength)
+{
+    POLY_STRING *pString = AllocString(NULL, iLength);
+
+    pString->RefCount = 1;
+    pString->Length = iLength;
+    pString->Hash = HashChars(pstrChars, iLength);
+    memcpy(pString->Chars, pstrChars, iLength);
+    pString->Chars[iLength] = '\0';
+
+    return pString->Chars;
+}
+
+/******************************************************************************************
+*
+*    Str_FromCStr()
+*
+*    Creates a string from a null-terminated C string.
+*/
+
+char *Str_FromCStr(const char *pstrString)
+{
+    return Str_New(pstrString, (int)strlen(pstrString));
+}
+
+/******************************************************************************************
+*
+*    Str_NewInterned()
+*
+*    Creates a string constant for a program's string table. It is shared by pointer and
+*    never reference counted; Str_FreeInterned() frees it with the program.
+*/
+
+char *Str_NewInterned(const char *pstrString)
+{
+    char *pstrInterned = Str_FromCStr(pstrString);
+    Str_Header(pstrInterned)->RefCount = STR_INTERNED;
+    return pstrInterned;
+}
+
+void Str_FreeInterned(char *pstrString)
+{
+    free(Str_Header(pstrString));
+}
+
+/******************************************************************************************
+*
+*    Str_Unshare()
+*
+*    Returns a reference to a string that another script can own: constants are shared,
+*    anything else is copied, since reference counts aren't synchronized between threads.
+*/
+
+char *Str_Unshare(char *pstrString)
+{
+    if (Str_Header(pstrString)->RefCount == STR_INTERNED)
+        return pstrString;
+
+    return Str_New(pstrString, Str_Length(pstrString));
+}
+
+// ----Number Formatting -------------------------------------------------------------------
+
+static int CountDigits(unsigned int uValue)
+{
+    int iDigits = 1;
+    while (uValue >= 10)
+    {
+        uValue /= 10;
+        ++iDigits;
+    }
+    return iDigits;
+}
+
+/******************************************************************************************
+*
+*    Str_FormatInt()
+*
+*    Writes an integer in decimal followed by a '\0' and returns the number of characters.
+*    The buffer needs room for STR_NUMBER_SIZE characters.
+*/
+
+int Str_FormatInt(int iValue, char *pstrBuffer)
+{
+    unsigned int uValue = iValue < 0 ? 0u - (unsigned int)iValue : (unsigned int)iValue;
+    int iLength = CountDigits(uValue) + (iValue < 0);
+
+    // 从最低位开始倒着写
+    char *pstrEnd = pstrBuffer + iLength;
+    *pstrEnd = '\0';
+    do
+    {
+        *--pstrEnd = (char)('0' + uValue % 10);
+        uValue /= 10;
+    } while (uValue);
+    if (iValue < 0)
+        *--pstrEnd = '-';
+
+    return iLength;
+}
+
+// 10的整数次幂，都能精确地表示为double
+static const double s_Pow10[] =
+{
+    1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+    1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+};
+
+// dValue * 10^iExp10
+static double ScalePow10(double dValue, int iExp10)
+{
+    while (iExp10 > 22)
+    {
+        dValue *= 1e22;
+        iExp10 -= 22;
+    }
+    while (iExp10 < -22)
+    {
+        dValue /= 1e22;
+        iExp10 += 22;
+    }
+    return iExp10 >= 0 ? dValue * s_Pow10[iExp10] : dValue / s_Pow10[-iExp10];
+}
+
+/******************************************************************************************
+*
+*    Str_FormatFloat()
+*
+*    Writes the shortest decimal that reads back as the same float, followed by a '\0',
+*    and returns the number of characters. Exponents outside -7..20 use e-notation, like
+*    JavaScript does. The buffer needs room for STR_NUMBER_SIZE characters.
+*/
+
+int Str_FormatFloat(float fValue, char *pstrBuffer)
+{
+    char *pstrOut = pstrBuffer;
+
+    if (fValue != fValue)
+    {
+        strcpy(pstrBuffer, "nan");
+        return 3;
+    }
+
+    if (fValue < 0 || (fValue == 0 && 1 / fValue < 0))
+    {
+        *pstrOut++ = '-';
+        fValue = -fValue;
+    }
+
+    if (fValue == 0 || fValue > FLT_MAX)
+    {
+        strcpy(pstrOut, fValue == 0 ? "0" : "inf");
+        return (int)(pstrOut - pstrBuffer) + (int)strlen(pstrOut);
+    }
+
+    // 首位有效数字的位置，log10()在10的整数次幂附近可能差一位
+    double dValue = fValue;
+    int iExp10 = (int)floor(log10(dValue));
+    double dLead = ScalePow10(dValue, -iExp10);
+    if (dLead >= 10)
+        ++iExp10;
+    else if (dLead < 1)
+        --iExp10;
+
+    // 从一位有效数字开始，找出最少的能还原成同一个float的位数，9位总是足够的
+    unsigned int uDigits = 0;
+    int iDigitCount;
+    for (iDigitCount = 1; iDigitCount <= 9; ++iDigitCount)
+    {
+        int iScale = iDigitCount - 1 - iExp10;
+        uDigits = (unsigned int)(ScalePow10(dValue, iScale) + 0.5);
+        if ((float)ScalePow10((double)uDigits, -iScale) == fValue)
+            break;
+    }
+    if (iDigitCount > 9)
+        iDigitCount = 9;
+
+    // 进位后多出一位，例如9.96舍入成10
+    if (uDigits >= (unsigned int)s_Pow10[iDigitCount])
+    {
+        uDigits /= 10;
+        ++iExp10;
+    }
+
+    // 去掉末尾的0
+    while (iDigitCount > 1 && uDigits % 10 == 0)
+    {
+        uDigits /= 10;
+        --iDigitCount;
+    }
+
+    char pstrDigits[10];
+    Str_FormatInt((int)uDigits, pstrDigits);
+
+    if (iExp10 >= 21 || iExp10 <= -7)
+    {
+        // d.ddde+XX
+        *pstrOut++ = pstrDigits[0];
+        if (iDigitCount > 1)
+        {
+            *pstrOut++ = '.';
+            memcpy(pstrOut, &pstrDigits[1], iDigitCount - 1);
+            pstrOut += iDigitCount - 1;
+        }
+        *pstrOut++ = 'e';
+        *pstrOut++ = iExp10 < 0 ? '-' : '+';
+        pstrOut += Str_FormatInt(iExp10 < 0 ? -iExp10 : iExp10, pstrOut);
+    }
+    else if (iExp10 < 0)
+    {
+        // 0.000ddd
+        *pstrOut++ = '0';
+        *pstrOut++ = '.';
+        for (int i = -1; i > iExp10; --i)
+            *pstrOut++ = '0';
+        memcpy(pstrOut, pstrDigits, iDigitCount);
+        pstrOut += iDigitCount;
+    }
+    else if (iDigitCount <= iExp10 + 1)
+    {
+        // ddd000
+        memcpy(pstrOut, pstrDigits, iDigitCount);
+        pstrOut += iDigitCount;
+        for (int i = iDigitCount; i <= iExp10; ++i)
+            *pstrOut++ = '0';
+    }
+    else
+    {
+        // ddd.ddd
+        memcpy(pstrOut, pstrDigits, iExp10 + 1);
+        pstrOut += iExp10 + 1;
+        *pstrOut++ = '.';
+        memcpy(pstrOut, &pstrDigits[iExp10 + 1], iDigitCount - iExp10 - 1);
+        pstrOut += iDigitCount - iExp10 - 1;
+    }
+
+    *pstrOut = '\0';
+    return (int)(pstrOut - pstrBuffer);
+}
+
+// ----String Builder ----------------------------------------------------------------------
+
+static void Reserve(STR_BUILDER *pBuilder, int iExtra)
+{
+    int iNeeded = pBuilder->pString->Length + iExtra;
+    if (iNeeded <= pBuilder->Capacity)
+        return;
+
+    int iCapacity = pBuilder->Capacity * 2;
+    if (iCapacity < iNeeded)
+        iCapacity = iNeeded;
+
+    pBuilder->pString = AllocString(pBuilder->pString, iCapacity);
+    pBuilder->Capacity = iCapacity;
+}
+
+/******************************************************************************************
+*
+*    Str_ValueSizeHint()
+*
+*    Returns the number of characters a value is expected to take in a concatenation: exact
+*    for strings and integers, an upper bound for floats. Other types add nothing.
+*/
+
+int Str_ValueSizeHint(const PolyObject *pVal)
+{
+    switch (pVal->Type)
+    {
+    case OP_TYPE_STRING:
+        return Str_Length(pVal->String);
+
+    case OP_TYPE_INT:
+        if (pVal->Fixnum < 0)
+            return CountDigits(0u - (unsigned int)pVal->Fixnum) + 1;
+        return CountDigits((unsigned int)pVal->Fixnum);
+
+    case OP_TYPE_FLOAT:
+        return STR_NUMBER_SIZE - 1;
+
+    default:
+        return 0;
+    }
+}
+
+/******************************************************************************************
+*
+*    Str_BuilderInit()
+*
+*    Starts a string with room for iCapacity characters.
+*/
+
+void Str_BuilderInit(STR_BUILDER *pBuilder, int iCapacity)
+{
+    pBuilder->pString = AllocString(NULL, iCapacity);
+    pBuilder->pString->RefCount = 1;
+    pBuilder->pString->Length = 0;
+    pBuilder->Capacity = iCapacity;
+}
+
+void Str_BuilderAppend(STR_BUILDER *pBuilder, const char *pstrChars, int iLength)
+{
+    Reserve(pBuilder, iLength);
+
+    POLY_STRING *pString = pBuilder->pString;
+    memcpy(&pString->Chars[pString->Length], pstrChars, iLength);
+    pString->Length += iLength;
+}
+
+/******************************************************************************************
+*
+*    Str_BuilderAppendValue()
+*
+*    Appends a value the way string concatenation converts it. Numbers are formatted
+*    straight into the builder; the '\0' they write lands in the terminator's slot.
+*/
+
+void Str_BuilderAppendValue(STR_BUILDER *pBuilder, const PolyObject *pVal)
+{
+    POLY_STRING *pString;
+
+    switch (pVal->Type)
+    {
+    case OP_TYPE_STRING:
+        Str_BuilderAppend(pBuilder, pVal->String, Str_Length(pVal->String));
+        break;
+
+    case OP_TYPE_INT:
+        Reserve(pBuilder, Str_ValueSizeHint(pVal));
+        pString = pBuilder->pString;
+        pString->Length += Str_FormatInt(pVal->Fixnum, &pString->Chars[pString->Length]);
+        break;
+
+    case OP_TYPE_FLOAT:
+        Reserve(pBuilder, STR_NUMBER_SIZE - 1);
+        pString = pBuilder->pString;
+        pString->Length += Str_FormatFloat(pVal->Realnum, &pString->Chars[pString->Length]);
+        break;
+    }
+}
+
+/******************************************************************************************
+*
+*    Str_BuilderFinish()
+*
+*    Terminates the string and returns it with a reference count of one. The builder must
+*    be initialized again before it is reused.
+*/
+
+char *Str_BuilderFinish(STR_BUILDER *pBuilder)
+{
+    POLY_STRING *pString = pBuilder->pString;
+    pString->Chars[pString->Length] = '\0';
+    pString->Hash = HashChars(pString->Chars, pString->Length);
+
+    pBuilder->pString = NULL;
+    pBuilder->Capacity = 0;
+
+    return pString->Chars;
+}
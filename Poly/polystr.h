@@ -0,0 +1,92 @@
+#ifndef __POLYSTR_H__
+#define __POLYSTR_H__
+
+#include <stddef.h>
+#include "vm.h"
+
+// -------- Immutable Strings ---------------------------------
+
+// 不可变字符串。PolyObject::String指向Chars，头部紧挨在字符数据之前，
+// 所以宿主和虚拟机仍然可以把它当作普通的C字符串读取。复制字符串值只增加引用计数
+struct POLY_STRING
+{
+    long RefCount;      // 引用计数，STR_INTERNED表示驻留字符串
+    int Length;         // 字符个数，不含结尾的'\0'
+    unsigned int Hash;  // 内容的哈希值
+    char Chars[1];      // 以'\0'结尾的字符数据
+};
+
+// 驻留字符串属于程序，在程序释放时才释放；宿主创建的静态字符串(Poly_CreateStaticString())
+// 也按驻留字符串处理。共享程序的实例可能在不同的线程上运行，所以驻留字符串不计数，
+// 运行时创建的字符串只属于一个实例
+#define STR_INTERNED -1
+
+char *Str_New(const char *pstrChars, int iLength);
+char *Str_FromCStr(const char *pstrString);
+char *Str_NewInterned(const char *pstrString);
+void Str_FreeInterned(char *pstrString);
+char *Str_Unshare(char *pstrString);
+
+// -------- Number Formatting ---------------------------------------------------
+
+// 格式化一个数字最多需要的字符个数，含结尾的'\0'
+#define STR_NUMBER_SIZE 24
+
+int Str_FormatInt(int iValue, char *pstrBuffer);
+int Str_FormatFloat(float fValue, char *pstrBuffer);
+
+// -------- String Builder ------------------------------------------------------
+
+// 拼接字符串用的缓冲区。先按各段的长度预留空间，结果字符串只分配一次；
+// 预留不够时容量成倍增长
+struct STR_BUILDER
+{
+    POLY_STRING *pString;   // 正在构造的字符串，Length是已经写入的字符个数
+    int Capacity;           // 能容纳的字符个数，不含结尾的'\0'
+};
+
+int Str_ValueSizeHint(const PolyObject *pVal);
+void Str_BuilderInit(STR_BUILDER *pBuilder, int iCapacity);
+void Str_BuilderAppend(STR_BUILDER *pBuilder, const char *pstrChars, int iLength);
+void Str_BuilderAppendValue(STR_BUILDER *pBuilder, const PolyObject *pVal);
+char *Str_BuilderFinish(STR_BUILDER *pBuilder);
+
+static inline POLY_STRING *Str_Header(const char *pstrString)
+{
+    return (POLY_STRING *)(pstrString - offsetof(POLY_STRING, Chars));
+}
+
+static inline int Str_Length(const char *pstrString)
+{
+    return Str_Header(pstrString)->Length;
+}
+
+static inline void Str_Retain(char *pstrString)
+{
+    POLY_STRING *pString = Str_Header(pstrString);
+    if (pString->RefCount != STR_INTERNED)
+        pString->RefCount++;
+}
+
+static inline void Str_Release(char *pstrString)
+{
+    POLY_STRING *pString = Str_Header(pstrString);
+    if (pString->RefCount != STR_INTERNED && --pString->RefCount == 0)
+        free(pString);
+}
+
+// 同一个字符串或者驻留的常量只比较指针；长度或哈希不同时不必比较内容
+static inline int Str_Equal(const char *pstrString0, const char *pstrString1)
+{
+    if (pstrString0 == pstrString1)
+        return TRUE;
+
+    POLY_STRING *pString0 = Str_Header(pstrString0);
+    POLY_STRING *pString1 = Str_Header(pstrString1);
+    if (pString0->Length != pString1->Length || pString0->Hash != pString1->Hash)
+        return FALSE;
+
+    return memcmp(pstrString0, pstrString1, pString0->Length) == 0;
+}
+
+#endif	/* __POLYSTR_H__ */
@@ -0,0 +1,413 @@
+/* 管理大量脚本实例的调度器 */
+
+#include <stdlib.h>
+#include "poly.h"
+#include "dispatch.h"
+
+// ----Scheduling Rules --------------------------------------------------------------------
+//
+// 每次Poly_SchedulerTick()只读取一次时钟：
+//
+//   就绪队列    按优先级分为高、中、低三个队列，依次运行。每个脚本执行一个指令预算，
+//               预算用完仍可运行的脚本排到队尾，在下一次tick继续
+//   时间轮      暂停的脚本按PauseEndTime挂在分层时间轮上，到期后回到就绪队列，
+//               睡眠中的脚本不占用任何调度开销
+//   结束队列    Main()已经返回的脚本不再运行，直到宿主将它移出调度器
+//
+// 指令预算由优先级决定：低 = 1个时间片，中(或未指定) = 2个，高 = 4个。
+// 用户定义优先级的脚本与中优先级一同运行，UserPriority即它的指令预算。
+
+#define SCHED_DEFAULT_QUANTUM 1000 // 低优先级脚本每次tick执行的指令条数
+
+#define SCHED_QUEUE_HIGH 0
+#define SCHED_QUEUE_MED 1
+#define SCHED_QUEUE_LOW 2
+#define SCHED_QUEUE_COUNT 3
+
+// 时间轮：0号轮256个槽位，每个槽位1毫秒；之上4级各64个槽位，覆盖全部32位时钟
+#define WHEEL_ROOT_BITS 8
+#define WHEEL_ROOT_SIZE (1 << WHEEL_ROOT_BITS)
+#define WHEEL_LEVEL_BITS 6
+#define WHEEL_LEVEL_SIZE (1 << WHEEL_LEVEL_BITS)
+#define WHEEL_LEVELS 4
+
+#define WHEEL_LEVEL_SHIFT(l) (WHEEL_ROOT_BITS + (l) * WHEEL_LEVEL_BITS)
+
+// ----Data Structures -----------------------------------------------------------------------
+
+struct SCHED_LIST
+{
+    SCHED_ENTRY *Head;
+    SCHED_ENTRY *Tail;
+    int Count;
+};
+
+struct SCHED_ENTRY
+{
+    script_env *sc;          // 调度的脚本，在运行中被移出时为NULL
+    poly_scheduler *Sched;   // 所属的调度器
+    SCHED_LIST *List;        // 当前所在的链表
+    SCHED_ENTRY *Prev;
+    SCHED_ENTRY *Next;
+};
+
+struct poly_scheduler
+{
+    int Quantum;         // 低优先级脚本的指令预算
+    int Count;           // 拥有的脚本个数
+
+    SCHED_LIST Ready[SCHED_QUEUE_COUNT];
+    SCHED_LIST Done;
+
+    unsigned int WheelTime;                           // 时间轮走到的时刻
+    int WheelCount;                                   // 时间轮中的脚本个数
+    SCHED_LIST Root[WHEEL_ROOT_SIZE];                 // 0号轮
+    SCHED_LIST Levels[WHEEL_LEVELS][WHEEL_LEVEL_SIZE]; // 上层时间轮
+
+    SCHED_ENTRY *Running; // 正在运行的脚本
+};
+
+// ----Lists ---------------------------------------------------------------------------------
+
+static void ListAppend(SCHED_LIST *pList, SCHED_ENTRY *pEntry)
+{
+    pEntry->List = pList;
+    pEntry->Next = NULL;
+    pEntry->Prev = pList->Tail;
+
+    if (pList->Tail)
+        pList->Tail->Next = pEntry;
+    else
+        pList->Head = pEntry;
+
+    pList->Tail = pEntry;
+    pList->Count++;
+}
+
+static void ListUnlink(SCHED_ENTRY *pEntry)
+{
+    SCHED_LIST *pList = pEntry->List;
+    if (!pList)
+        return;
+
+    if (pEntry->Prev)
+        pEntry->Prev->Next = pEntry->Next;
+    else
+        pList->Head = pEntry->Next;
+
+    if (pEntry->Next)
+        pEntry->Next->Prev = pEntry->Prev;
+    else
+        pList->Tail = pEntry->Prev;
+
+    pList->Count--;
+    pEntry->List = NULL;
+    pEntry->Prev = pEntry->Next = NULL;
+}
+
+// ----Timer Wheel ---------------------------------------------------------------------------
+
+static int IsInWheel(poly_scheduler *sched, SCHED_LIST *pList)
+{
+    return pList >= &sched->Root[0] &&
+           pList <= &sched->Levels[WHEEL_LEVELS - 1][WHEEL_LEVEL_SIZE - 1];
+}
+
+static void Unlink(poly_scheduler *sched, SCHED_ENTRY *pEntry)
+{
+    if (IsInWheel(sched, pEntry->List))
+        sched->WheelCount--;
+    ListUnlink(pEntry);
+}
+
+static int GetReadyQueue(script_env *sc)
+{
+    switch (sc->PriorityType)
+    {
+    case POLY_PRIORITY_HIGH:
+        return SCHED_QUEUE_HIGH;
+    case POLY_PRIORITY_LOW:
+        return SCHED_QUEUE_LOW;
+    default:
+        return SCHED_QUEUE_MED;
+    }
+}
+
+static int GetInstrBudget(poly_scheduler *sched, script_env *sc)
+{
+    switch (sc->PriorityType)
+    {
+    case POLY_PRIORITY_HIGH:
+        return sched->Quantum * 4;
+    case POLY_PRIORITY_LOW:
+        return sched->Quantum;
+    case POLY_PRIORITY_USER:
+        if (sc->UserPriority > 0)
+            return sc->UserPriority;
+        // fall through
+    default:
+        return sched->Quantum * 2;
+    }
+}
+
+static void MakeReady(poly_scheduler *sched, SCHED_ENTRY *pEntry)
+{
+    ListAppend(&sched->Ready[GetReadyQueue(pEntry->sc)], pEntry);
+}
+
+// 按唤醒时刻与时间轮当前时刻的距离选择槽位
+static void WheelInsert(poly_scheduler *sched, SCHED_ENTRY *pEntry)
+{
+    unsigned int uExpires = (unsigned int)pEntry->sc->PauseEndTime;
+    unsigned int uDelta = uExpires - sched->WheelTime;
+    SCHED_LIST *pSlot;
+
+    if (uDelta < WHEEL_ROOT_SIZE)
+    {
+        pSlot = &sched->Root[uExpires & (WHEEL_ROOT_SIZE - 1)];
+    }
+    else
+    {
+        int iLevel = 0;
+        while (iLevel < WHEEL_LEVELS - 1 && uDelta >= 1u << WHEEL_LEVEL_SHIFT(iLevel + 1))
+            ++iLevel;
+        pSlot = &sched->Levels[iLevel][(uExpires >> WHEEL_LEVEL_SHIFT(iLevel)) & (WHEEL_LEVEL_SIZE - 1)];
+    }
+
+    ListAppend(pSlot, pEntry);
+    sched->WheelCount++;
+}
+
+// 把上层时间轮一个槽位中的脚本重新分配到更低的层
+static void WheelCascade(poly_scheduler *sched, SCHED_LIST *pSlot)
+{
+    SCHED_ENTRY *pEntry;
+    while ((pEntry = pSlot->Head) != NULL)
+    {
+        Unlink(sched, pEntry);
+        WheelInsert(sched, pEntry);
+    }
+}
+
+// 时间轮走到iNow，唤醒所有到期的脚本
+static void WheelAdvance(poly_scheduler *sched, int iNow)
+{
+    unsigned int uNow = (unsigned int)iNow;
+
+    while ((int)(uNow - sched->WheelTime) >= 0)
+    {
+        // 时间轮为空时无需逐个槽位地走
+        if (sched->WheelCount == 0)
+        {
+            sched->WheelTime = uNow + 1;
+            break;
+        }
+
+        unsigned int uIndex = sched->WheelTime & (WHEEL_ROOT_SIZE - 1);
+
+        if (uIndex == 0)
+        {
+            for (int iLevel = 0; iLevel < WHEEL_LEVELS; ++iLevel)
+            {
+                unsigned int uSlot = (sched->WheelTime >> WHEEL_LEVEL_SHIFT(iLevel)) & (WHEEL_LEVEL_SIZE - 1);
+                WheelCascade(sched, &sched->Levels[iLevel][uSlot]);
+                if (uSlot != 0)
+                    break;
+            }
+        }
+
+        SCHED_LIST *pSlot = &sched->Root[uIndex];
+        SCHED_ENTRY *pEntry;
+        while ((pEntry = pSlot->Head) != NULL)
+        {
+            Unlink(sched, pEntry);
+
+            // 暂停已经结束，运行时不必再读取时钟
+            pEntry->sc->IsPaused = FALSE;
+            MakeReady(sched, pEntry);
+        }
+
+        sched->WheelTime++;
+    }
+}
+
+// 关闭链表中的所有脚本
+static void ShutDownList(SCHED_LIST *pList)
+{
+    SCHED_ENTRY *pEntry;
+    while ((pEntry = pList->Head) != NULL)
+    {
+        ListUnlink(pEntry);
+        Poly_ShutDown(pEntry->sc);
+        free(pEntry);
+    }
+}
+
+// 按脚本当前的状态把它放入就绪队列、时间轮或结束队列
+static void Reschedule(poly_scheduler *sched, SCHED_ENTRY *pEntry, int iNow)
+{
+    script_env *sc = pEntry->sc;
+
+    if (Poly_IsScriptStop(sc))
+        ListAppend(&sched->Done, pEntry);
+    else if (sc->IsPaused && (int)(sc->PauseEndTime - iNow) > 0)
+        WheelInsert(sched, pEntry);
+    else
+        MakeReady(sched, pEntry);
+}
+
+/******************************************************************************************
+*
+*  Poly_CreateScheduler()
+*
+*  Creates a scheduler for many script instances. iQuantum is the number of instructions
+*  a low priority script runs per tick; 0 selects the default.
+*/
+
+poly_scheduler *Poly_CreateScheduler(int iQuantum)
+{
+    poly_scheduler *sched = (poly_scheduler *)calloc(1, sizeof(poly_scheduler));
+    if (!sched)
+        return NULL;
+
+    sched->Quantum = iQuantum > 0 ? iQuantum : SCHED_DEFAULT_QUANTUM;
+    sched->WheelTime = (unsigned int)GetCurrTime();
+
+    return sched;
+}
+
+/******************************************************************************************
+*
+*  Poly_DestroyScheduler()
+*
+*  Shuts down every script the scheduler still owns and frees the scheduler.
+*/
+
+void Poly_DestroyScheduler(poly_scheduler *sched)
+{
+    if (!sched)
+        return;
+
+    for (int i = 0; i < SCHED_QUEUE_COUNT; ++i)
+        ShutDownList(&sched->Ready[i]);
+    ShutDownList(&sched->Done);
+
+    for (int i = 0; i < WHEEL_ROOT_SIZE; ++i)
+        ShutDownList(&sched->Root[i]);
+
+    for (int l = 0; l < WHEEL_LEVELS; ++l)
+        for (int i = 0; i < WHEEL_LEVEL_SIZE; ++i)
+            ShutDownList(&sched->Levels[l][i]);
+
+    free(sched);
+}
+
+/******************************************************************************************
+*
+*  Poly_SchedulerAdd()
+*
+*  Hands a loaded script over to the scheduler, which will run it from Main(). Returns
+*  FALSE if the script already belongs to a scheduler.
+*/
+
+int Poly_SchedulerAdd(poly_scheduler *sched, script_env *sc)
+{
+    if (!sched || !sc || sc->SchedEntry)
+        return FALSE;
+
+    SCHED_ENTRY *pEntry = (SCHED_ENTRY *)calloc(1, sizeof(SCHED_ENTRY));
+    if (!pEntry)
+        return FALSE;
+
+    pEntry->sc = sc;
+    pEntry->Sched = sched;
+    sc->SchedEntry = pEntry;
+
+    MakeReady(sched, pEntry);
+    sched->Count++;
+
+    return TRUE;
+}
+
+/******************************************************************************************
+*
+*  Poly_SchedulerRemove()
+*
+*  Takes a script back from the scheduler; the host owns it again afterwards. May be
+*  called from a host function of the script being run.
+*/
+
+int Poly_SchedulerRemove(poly_scheduler *sched, script_env *sc)
+{
+    if (!sched || !sc || !sc->SchedEntry || sc->SchedEntry->Sched != sched)
+        return FALSE;
+
+    SCHED_ENTRY *pEntry = sc->SchedEntry;
+    sc->SchedEntry = NULL;
+    sched->Count--;
+
+    // 正在运行的脚本由Poly_SchedulerTick()在它返回后释放
+    if (pEntry == sched->Running)
+    {
+        pEntry->sc = NULL;
+        return TRUE;
+    }
+
+    Unlink(sched, pEntry);
+    free(pEntry);
+
+    return TRUE;
+}
+
+/******************************************************************************************
+*
+*  Poly_SchedulerTick()
+*
+*  Wakes the scripts whose pause has ended and runs every runnable script once, high
+*  priority scripts first. Returns the number of scripts that haven't finished yet.
+*/
+
+int Poly_SchedulerTick(poly_scheduler *sched)
+{
+    int iNow = GetCurrTime();
+
+    WheelAdvance(sched, iNow);
+
+    for (int q = 0; q < SCHED_QUEUE_COUNT; ++q)
+    {
+        SCHED_LIST *pQueue = &sched->Ready[q];
+
+        // 只运行本次tick开始时已经就绪的脚本，重新排队的脚本留到下一次tick
+        int iBatch = pQueue->Count;
+
+        while (iBatch-- > 0 && pQueue->Head)
+        {
+            SCHED_ENTRY *pEntry = pQueue->Head;
+            script_env *sc = pEntry->sc;
+            ListUnlink(pEntry);
+
+            // 宿主可能在两次tick之间暂停了脚本
+            if (sc->IsPaused && (int)(sc->PauseEndTime - iNow) > 0)
+            {
+                WheelInsert(sched, pEntry);
+                continue;
+            }
+            sc->IsPaused = FALSE;
+
+            sched->Running = pEntry;
+            Poly_RunScriptInstructions(sc, GetInstrBudget(sched, sc));
+            sched->Running = NULL;
+
+            // 脚本在运行中被移出了调度器
+            if (!pEntry->sc)
+            {
+                free(pEntry);
+                continue;
+            }
+
+            Reschedule(sched, pEntry, iNow);
+        }
+    }
+
+    return sched->Count - sched->Done.Count;
+}
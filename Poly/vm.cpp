@@ -4,15 +4,28 @@
 #include "poly.h"
 #include "gc.h"
 #include "instruction.h"
+#include "dispatch.h"
+#include "polystr.h"
 #include "vm.h"
 #include "compiler/xsc.h"
 #include <ctype.h>
+#include <limits.h>
 #include <time.h>
+#include <mutex>
+#include <chrono>
 
 // ----The Global Host API ----------------------------------------------------------------------
 HOST_API_FUNC *g_HostAPIs; // The host API
 
+// 每次注册全局宿主函数时递增，使所有脚本的绑定表失效。从1开始，新脚本的绑定表总是先失效
+static unsigned int g_HostAPIEpoch = 1;
+
+// 编译器使用全局状态，多个线程同时载入脚本时必须串行编译
+static std::mutex g_CompileLock;
+
 static int LoadPE(script_env *sc, const char *pstrFilename);
+static int RegisterHostFunc(script_env *sc, const char *pstrName, POLY_HOST_FUNCTION fnFunc,
+                            int iSignature, int iParamCount, HOST_NATIVE_FUNC fnNative);
 
 #ifdef WIN32
 #define stricmp _stricmp
@@ -52,18 +65,43 @@ inline int ResolveStackIndex(int iFrameIndex, int iIndex)
     return (iIndex < 0 ? iIndex += iFrameIndex : iIndex);
 }
 
+// 批量调用中字符串列的缓存。宿主的字符串是普通的C字符串，指针不变时不必重新创建
+struct BATCH_STRING
+{
+    const char *Source;
+    char *String;
+};
+
+// 批量调用(Poly_CallScriptFuncBatch())的状态。函数的栈帧只建立一次，每一行只改写实参
+struct HOST_BATCH
+{
+    HOST_BATCH *Prev;            // 宿主函数中嵌套的批量调用
+    int FuncIndex;
+    int FrameIndex;              // 被调函数的栈帧，只有它返回时才进入下一行
+    int ArgBase;                 // 实参在栈上的位置
+    const PolyObject *Args;
+    int ArgCount;
+    int Count;
+    int Row;                     // 正在执行的行
+    PolyObject *Results;         // 已完成的行的返回值，批量调用期间是GC的根
+    BATCH_STRING *ArgStrings;
+};
+
 // ----Function Prototypes -------------------------------------------------------------------
 
 void DisplayStatus(script_env *sc);
 
 // GC
-static void RunGC(script_env *sc);
+void RunGC(script_env *sc);
+static void CollectNursery(script_env *sc);
 
 // ----Operand Interface -----------------------------------------------------------------
 
 int CoerceValueToInt(PolyObject *Val);
 float CoerceValueToFloat(PolyObject *Val);
-char *CoerceValueToString(PolyObject *Val);
+char *CoerceValueToString(script_env *sc, PolyObject *Val);
+static void ReleaseCoercions(script_env *sc, int iTop, COERCION_BLOCK *pKeep);
+static POLY_STRING_VIEW GetValueAsStringView(script_env *sc, PolyObject *Val);
 
 int GetOpType(script_env *sc, int OpIndex);
 int ResolveOpRelStackIndex(script_env *sc, PolyObject *OpValue);
@@ -99,6 +137,7 @@ int GetCurrTime();
 // ----Functions -------------------------------------------------------------------------
 
 void CallFunc(script_env *sc, int iIndex, int type);
+int GetFuncIndexByName(script_env *sc, const char *pstrName);
 
 // ----Functions -----------------------------------------------------------------------------
 
@@ -131,10 +170,19 @@ script_env *Poly_Initialize()
     sc->FuncTable.Funcs = NULL;
     sc->HostCallTable.Calls = NULL;
     sc->HostAPIs = NULL;
+    sc->HostBindings = NULL;
+    sc->HostBindingEpoch = 0;
+    sc->HostArgBase = 0;
+    sc->HostArgCount = 0;
+    sc->CoercionTop = 0;
 
-    sc->pLastObject = NULL;
-    sc->iNumberOfObjects = 0;
-    sc->iMaxObjects = INITIAL_GC_THRESHOLD;
+    sc->GCThreshold = INITIAL_GC_THRESHOLD;
+    sc->GCMinThreshold = INITIAL_GC_THRESHOLD;
+    sc->GCGrowth = GC_DEFAULT_GROWTH;
+
+    sc->Engine = POLY_ENGINE_THREADED;
+    sc->Fusion = TRUE;
+    sc->InstrCount = 0;
 
     return sc;
 }
@@ -241,12 +289,12 @@ static int LoadPE(script_env *sc, const char *pstrFilename)
 
     // Read the priority type (1 byte)
 
-    int iPriorityType = 0;
-    fread(&iPriorityType, 1, 1, pScriptFile);
+    sc->PriorityType = 0;
+    fread(&sc->PriorityType, 1, 1, pScriptFile);
 
     // Read the user-defined priority (4 bytes)
-    // Unused field
-    fread(&sc->TimesliceDur, 4, 1, pScriptFile);
+
+    fread(&sc->UserPriority, 4, 1, pScriptFile);
 
     // ----Read the instruction stream
 
@@ -254,11 +302,15 @@ static int LoadPE(script_env *sc, const char *pstrFilename)
 
     fread(&sc->InstrStream.Size, 4, 1, pScriptFile);
 
-    // Allocate the stream
+    // Allocate the stream, plus the INSTR_HALT sentinel
 
-    if (!(sc->InstrStream.Instrs = (INSTR *)malloc(sc->InstrStream.Size * sizeof(INSTR))))
+    if (!(sc->InstrStream.Instrs = (INSTR *)malloc((sc->InstrStream.Size + 1) * sizeof(INSTR))))
         return POLY_LOAD_ERROR_OUT_OF_MEMORY;
 
+    sc->InstrStream.Instrs[sc->InstrStream.Size].Opcode = INSTR_HALT;
+    sc->InstrStream.Instrs[sc->InstrStream.Size].OpCount = 0;
+    sc->InstrStream.Instrs[sc->InstrStream.Size].pOpList = NULL;
+
     // Read the instruction data
 
     for (int CurrInstrIndex = 0; CurrInstrIndex < sc->InstrStream.Size; ++CurrInstrIndex)
@@ -287,8 +339,9 @@ static int LoadPE(script_env *sc, const char *pstrFilename)
         {
             // Read in the operand type (1 byte)
 
-            pOpList[iCurrOpIndex].Type = 0;
-            fread(&pOpList[iCurrOpIndex].Type, 1, 1, pScriptFile);
+            unsigned char cType = 0;
+            fread(&cType, 1, 1, pScriptFile);
+            pOpList[iCurrOpIndex].Type = cType;
 
             // Depending on the type, read in the operand data
 
@@ -333,9 +386,14 @@ static int LoadPE(script_env *sc, const char *pstrFilename)
                 // Relative stack index
 
             case OP_TYPE_REL_STACK_INDEX:
+            {
+                // OffsetIndex可能是位域，不能直接读入
+                int iOffsetIndex;
                 fread(&pOpList[iCurrOpIndex].StackIndex, sizeof(int), 1, pScriptFile);
-                fread(&pOpList[iCurrOpIndex].OffsetIndex, sizeof(int), 1, pScriptFile);
+                fread(&iOffsetIndex, sizeof(int), 1, pScriptFile);
+                pOpList[iCurrOpIndex].OffsetIndex = iOffsetIndex;
                 break;
+            }
 
                 // Function index
 
@@ -398,9 +456,10 @@ static int LoadPE(script_env *sc, const char *pstrFilename)
             fread(pstrCurrString, iStringSize, 1, pScriptFile);
             pstrCurrString[iStringSize] = '\0';
 
-            // Assign the string pointer to the string table
+            // 驻留到字符串常量表中
 
-            ppstrStringTable[i] = pstrCurrString;
+            ppstrStringTable[i] = Str_NewInterned(pstrCurrString);
+            free(pstrCurrString);
         }
 
         // Run through each operand in the instruction stream and assign copies of string
@@ -415,37 +474,21 @@ static int LoadPE(script_env *sc, const char *pstrFilename)
 
             for (int j = 0; j < iOpCount; ++j)
             {
-                // If the operand is a string index, make a local copy of it's corresponding
-                // string in the table
+                // If the operand is a string index, point it to the corresponding string
+                // in the table
 
                 if (pOpList[j].Type == OP_TYPE_STRING)
                 {
                     // Get the string index from the operand's integer literal field
 
                     int iStringIndex = pOpList[j].Fixnum;
-
-                    // Allocate a new string to hold a copy of the one in the table
-                    char *pstrStringCopy;
-                    if (!(pstrStringCopy = (char *)malloc(strlen(ppstrStringTable[iStringIndex]) + 1)))
-                        return POLY_LOAD_ERROR_OUT_OF_MEMORY;
-
-                    // Make a copy of the string
-
-                    strcpy(pstrStringCopy, ppstrStringTable[iStringIndex]);
-
-                    // Save the string pointer in the operand list
-
-                    pOpList[j].String = pstrStringCopy;
+                    pOpList[j].String = ppstrStringTable[iStringIndex];
                 }
             }
         }
 
-        // ----Free the original strings
-        for (int i = 0; i < iStringTableSize; ++i)
-            free(ppstrStringTable[i]);
-
-        // ----Free the string table itself
-        free(ppstrStringTable);
+        sc->StringTable.StringPool = ppstrStringTable;
+        sc->StringTable.Size = iStringTableSize;
     }
 
     // ----Read the function table
@@ -564,6 +607,12 @@ void Poly_ShutDown(script_env *sc)
     free(sc);
 }
 
+// 脚本是否在用自己降级的代码，而不是程序共享的代码
+static int HasPrivateCode(script_env *sc)
+{
+    return sc->Program && sc->Code.Codes != sc->Program->Image.Code.Codes;
+}
+
 /******************************************************************************************
 *
 *    Poly_UnloadScript()
@@ -573,29 +622,7 @@ void Poly_ShutDown(script_env *sc)
 
 void Poly_UnloadScript(script_env *sc)
 {
-    // ----Free The instruction stream
-
-    // First check to see if any instructions have string operands, and free them if they
-    // do
-
-    for (int i = 0; i < sc->InstrStream.Size; ++i)
-    {
-        // Make a local copy of the operand count and operand list
-
-        int iOpCount = sc->InstrStream.Instrs[i].OpCount;
-        PolyObject *pOpList = sc->InstrStream.Instrs[i].pOpList;
-
-        // Loop through each operand and free its string pointer
-
-        for (int j = 0; j < iOpCount; ++j)
-            if (pOpList[j].Type == OP_TYPE_STRING)
-                free(pOpList[j].String);
-    }
-
-    // Now free the stream itself
-
-    if (sc->InstrStream.Instrs)
-        free(sc->InstrStream.Instrs);
+    ReleaseCoercions(sc, 0, NULL);
 
     // ----Free the runtime stack
 
@@ -603,17 +630,21 @@ void Poly_UnloadScript(script_env *sc)
 
     for (int i = 0; i < sc->iStackSize; ++i)
         if (sc->stack[i].Type == OP_TYPE_STRING)
-            free(sc->stack[i].String);
+            Str_Release(sc->stack[i].String);
+
+    if (sc->_RetVal.Type == OP_TYPE_STRING)
+        Str_Release(sc->_RetVal.String);
+    sc->_RetVal.Type = OP_TYPE_NULL;
 
     // Now free the stack itself
 
     if (sc->stack)
         free(sc->stack);
+    sc->stack = NULL;
+    sc->iStackSize = 0;
 
-    // ----Free the function table
-
-    if (sc->FuncTable.Funcs)
-        free(sc->FuncTable.Funcs);
+    // ---- Free the heap
+    GC_DestroyHeap(&sc->Heap);
 
     // ---- Free registered host API
     while (sc->HostAPIs)
@@ -623,18 +654,325 @@ void Poly_UnloadScript(script_env *sc)
         free(pFunc);
     }
 
+    if (sc->HostBindings)
+        free(sc->HostBindings);
+    sc->HostBindings = NULL;
+    sc->HostBindingEpoch = 0;
+
+    // ----Release the program
+
+    // Poly_SetFusion()可能给了脚本自己的代码
+    if (HasPrivateCode(sc))
+        FreeCodeStream(sc);
+
+    if (sc->Program)
+        Poly_ReleaseProgram(sc->Program);
+
+    sc->Program = NULL;
+    memset(&sc->InstrStream, 0, sizeof(sc->InstrStream));
+    memset(&sc->Code, 0, sizeof(sc->Code));
+    memset(&sc->FuncTable, 0, sizeof(sc->FuncTable));
+    memset(&sc->HostCallTable, 0, sizeof(sc->HostCallTable));
+    memset(&sc->StringTable, 0, sizeof(sc->StringTable));
+}
+
+/******************************************************************************************
+*
+*    FreeProgram()
+*
+*    Frees the code and tables of a program once its last reference is gone.
+*/
+
+static void FreeProgram(poly_program *prog)
+{
+    script_env *pImage = &prog->Image;
+
+    // ----Free The instruction stream
+
+    // 字符串操作数指向字符串常量表，随常量表一起释放
+
+    for (int i = 0; i < pImage->InstrStream.Size; ++i)
+        free(pImage->InstrStream.Instrs[i].pOpList);
+
+    // Now free the stream itself
+
+    if (pImage->InstrStream.Instrs)
+        free(pImage->InstrStream.Instrs);
+
+    // 预解码的指令流
+    FreeCodeStream(pImage);
+
+    // ----Free the function table
+
+    if (pImage->FuncTable.Funcs)
+        free(pImage->FuncTable.Funcs);
+
     // ---Free the host API call table
 
     // First free each string in the table individually
 
-    for (int i = 0; i < sc->HostCallTable.Size; ++i)
-        if (sc->HostCallTable.Calls[i])
-            free(sc->HostCallTable.Calls[i]);
+    for (int i = 0; i < pImage->HostCallTable.Size; ++i)
+        if (pImage->HostCallTable.Calls[i])
+            free(pImage->HostCallTable.Calls[i]);
 
     // Now free the table itself
 
-    if (sc->HostCallTable.Calls)
-        free(sc->HostCallTable.Calls);
+    if (pImage->HostCallTable.Calls)
+        free(pImage->HostCallTable.Calls);
+
+    // ----Free the string table
+
+    for (int i = 0; i < pImage->StringTable.Size; ++i)
+        Str_FreeInterned(pImage->StringTable.StringPool[i]);
+
+    if (pImage->StringTable.StringPool)
+        free(pImage->StringTable.StringPool);
+
+    delete prog;
+}
+
+/******************************************************************************************
+*
+*    CompileProgram()
+*
+*    Compiles a script into a new program with a reference count of one. Returns NULL if
+*    out of memory.
+*/
+
+static poly_program *CompileProgram(const char *pstrFilename, int iFusion)
+{
+    poly_program *prog = new poly_program;
+    prog->RefCount = 1;
+    memset(&prog->Image, 0, sizeof(prog->Image));
+    prog->Image.Fusion = iFusion;
+
+    // 编译
+    CompilerOption option;
+    option.save_debug_info = TRUE;
+    {
+        std::lock_guard<std::mutex> lock(g_CompileLock);
+        XSC_CompileScript(&prog->Image, pstrFilename, &option);
+    }
+
+    // 降级为预解码的指令流
+    if (!LowerInstrStream(&prog->Image) || !MeasureStackDepths(&prog->Image))
+    {
+        FreeProgram(prog);
+        return NULL;
+    }
+
+    return prog;
+}
+
+// 实例堆栈的初始大小，至少能容纳全局变量
+static int InitialStackSize(script_env *pImage)
+{
+    int iStackSize = pImage->GlobalDataSize + DEF_STACK_SIZE;
+    return pImage->iStackSize > iStackSize ? pImage->iStackSize : iStackSize;
+}
+
+/******************************************************************************************
+*
+*    AttachProgram()
+*
+*    Makes a script an instance of a program: copies the header and the table descriptors,
+*    allocates a private stack and resets the script.
+*/
+
+static int AttachProgram(script_env *sc, poly_program *prog)
+{
+    script_env *pImage = &prog->Image;
+
+    // 分配堆栈，调用函数时按需增长
+    int iStackSize = InitialStackSize(pImage);
+    PolyObject *pStack = (PolyObject *)malloc(iStackSize * sizeof(PolyObject));
+    if (!pStack)
+        return FALSE;
+    for (int i = 0; i < iStackSize; ++i)
+        pStack[i].Type = OP_TYPE_NULL;
+
+    Poly_RetainProgram(prog);
+    sc->Program = prog;
+
+    sc->GlobalDataSize = pImage->GlobalDataSize;
+    sc->IsMainFuncPresent = pImage->IsMainFuncPresent;
+    sc->MainFuncIndex = pImage->MainFuncIndex;
+    sc->PriorityType = pImage->PriorityType;
+    sc->UserPriority = pImage->UserPriority;
+    sc->Fusion = pImage->Fusion;
+
+    sc->InstrStream = pImage->InstrStream;
+    sc->Code = pImage->Code;
+    sc->FuncTable = pImage->FuncTable;
+    sc->HostCallTable = pImage->HostCallTable;
+    sc->StringTable = pImage->StringTable;
+
+    sc->stack = pStack;
+    sc->iStackSize = iStackSize;
+
+    // 清空堆栈并为全局变量分配空间
+    Poly_ResetInterp(sc);
+
+    return TRUE;
+}
+
+/******************************************************************************************
+*
+*    Poly_LoadProgram()
+*
+*    Compiles a script into a program that any number of instances can share. The caller
+*    owns one reference. Returns NULL on failure.
+*/
+
+poly_program *Poly_LoadProgram(const char *pstrFilename)
+{
+    return CompileProgram(pstrFilename, TRUE);
+}
+
+/******************************************************************************************
+*
+*    Poly_RetainProgram()
+*
+*    Adds a reference to a program.
+*/
+
+void Poly_RetainProgram(poly_program *prog)
+{
+    prog->RefCount++;
+}
+
+/******************************************************************************************
+*
+*    Poly_ReleaseProgram()
+*
+*    Drops a reference to a program, freeing it when it was the last one.
+*/
+
+void Poly_ReleaseProgram(poly_program *prog)
+{
+    if (--prog->RefCount == 0)
+        FreeProgram(prog);
+}
+
+/******************************************************************************************
+*
+*    Poly_CreateInstance()
+*
+*    Creates a script that runs the given program. Only the stack, registers, heap and run
+*    state are private; the code and tables are shared, and quickening rewrites opcodes in
+*    the shared code with relaxed atomic stores. Returns NULL if out of memory.
+*/
+
+script_env *Poly_CreateInstance(poly_program *prog)
+{
+    script_env *sc = Poly_Initialize();
+    if (!sc)
+        return NULL;
+
+    if (!AttachProgram(sc, prog))
+    {
+        free(sc);
+        return NULL;
+    }
+
+    return sc;
+}
+
+/******************************************************************************************
+*
+*    Poly_CloneScript()
+*
+*    Creates a new instance of a script's program in the same state as the script: the
+*    stack (including globals), registers, heap and run state are copied, objects are
+*    relocated and strings duplicated. The clone runs the code with the script's fusion
+*    setting, is not part of any scheduler and starts with an instruction count of zero.
+*    Returns NULL on failure.
+*/
+
+script_env *Poly_CloneScript(script_env *sc)
+{
+    if (!sc->Program)
+        return NULL;
+
+    script_env *pClone = Poly_CreateInstance(sc->Program);
+    if (!pClone)
+        return NULL;
+
+    // 指令索引与融合无关，副本按同样的设置降级即可继续运行
+    Poly_SetFusion(pClone, sc->Fusion);
+
+    // ----Heap
+
+    // 新生代对象先晋升，只需复制老年代
+    CollectNursery(sc);
+
+    GC_RELOC_MAP Relocs;
+    if (!GC_CloneObjects(&sc->Heap, &pClone->Heap, Relocs))
+    {
+        Poly_ShutDown(pClone);
+        return NULL;
+    }
+    pClone->GCThreshold = sc->GCThreshold;
+    pClone->GCMinThreshold = sc->GCMinThreshold;
+    pClone->GCGrowth = sc->GCGrowth;
+    pClone->GCTimeslice = sc->GCTimeslice;
+
+    // ----Stack and registers
+
+    if (!EnsureStack(pClone, sc->iTopIndex - pClone->iTopIndex))
+    {
+        Poly_ShutDown(pClone);
+        return NULL;
+    }
+
+    // 栈顶之上的槽位不再使用，保持为空。副本可能在其他线程上运行，不能和原脚本共享
+    // 字符串的引用计数
+    for (int i = 0; i < sc->iTopIndex; ++i)
+    {
+        pClone->stack[i] = sc->stack[i];
+        if (pClone->stack[i].Type == OP_TYPE_STRING)
+            pClone->stack[i].String = Str_Unshare(sc->stack[i].String);
+        GC_RelocateValue(&pClone->stack[i], Relocs);
+    }
+    pClone->iTopIndex = sc->iTopIndex;
+    pClone->iFrameIndex = sc->iFrameIndex;
+
+    pClone->_RetVal = sc->_RetVal;
+    if (pClone->_RetVal.Type == OP_TYPE_STRING)
+        pClone->_RetVal.String = Str_Unshare(sc->_RetVal.String);
+    GC_RelocateValue(&pClone->_RetVal, Relocs);
+    pClone->CurrInstr = sc->CurrInstr;
+
+    // ----Run state
+
+    pClone->IsRunning = sc->IsRunning;
+    pClone->IsMainActive = sc->IsMainActive;
+    pClone->IsPaused = sc->IsPaused;
+    pClone->PauseEndTime = sc->PauseEndTime;
+    pClone->ThreadActiveTime = sc->ThreadActiveTime;
+    pClone->TimesliceDur = sc->TimesliceDur;
+    pClone->ExitCode = sc->ExitCode;
+    pClone->Engine = sc->Engine;
+    pClone->PriorityType = sc->PriorityType;
+    pClone->UserPriority = sc->UserPriority;
+
+    // 脚本特定的宿主API
+    for (HOST_API_FUNC *pFunc = sc->HostAPIs; pFunc; pFunc = pFunc->Next)
+        RegisterHostFunc(pClone, pFunc->Name, pFunc->FuncPtr, pFunc->Signature, pFunc->ParamCount, pFunc->Native);
+
+    return pClone;
+}
+
+/******************************************************************************************
+*
+*    Poly_GetProgram()
+*
+*    Returns the program a script runs, without adding a reference.
+*/
+
+poly_program *Poly_GetProgram(script_env *sc)
+{
+    return sc->Program;
 }
 
 /******************************************************************************************
@@ -657,19 +995,39 @@ void Poly_ResetInterp(script_env *sc)
     // Set the entire stack to null
 
     for (int i = 0; i < sc->iStackSize; ++i)
+    {
+        if (sc->stack[i].Type == OP_TYPE_STRING)
+            Str_Release(sc->stack[i].String);
         sc->stack[i].Type = OP_TYPE_NULL;
+    }
+
+    // 返回值寄存器中的字符串同样持有引用，其中的对象也随堆一起释放
+    if (sc->_RetVal.Type == OP_TYPE_STRING)
+        Str_Release(sc->_RetVal.String);
+    sc->_RetVal.Type = OP_TYPE_NULL;
+
+    // 深度递归时增长的堆栈缩回初始大小
+    if (sc->Program && sc->iStackSize > InitialStackSize(&sc->Program->Image))
+    {
+        int iStackSize = InitialStackSize(&sc->Program->Image);
+        PolyObject *pStack = (PolyObject *)realloc(sc->stack, iStackSize * sizeof(PolyObject));
+        if (pStack)
+        {
+            sc->stack = pStack;
+            sc->iStackSize = iStackSize;
+        }
+    }
 
     // Free all allocated objects
-    GC_FreeAllObjects(sc->pLastObject);
+    GC_FreeAllObjects(&sc->Heap);
 
     // Reset GC state
-    sc->pLastObject = NULL;
-    sc->iNumberOfObjects = 0;
-    sc->iMaxObjects = INITIAL_GC_THRESHOLD;
+    sc->GCThreshold = sc->GCMinThreshold;
 
     // Unpause the script
 
     sc->IsPaused = FALSE;
+    sc->IsMainActive = FALSE;
 
     // Allocate space for the globals
 
@@ -678,38 +1036,29 @@ void Poly_ResetInterp(script_env *sc)
 
 /******************************************************************************************
 *
-*    ExecuteInstructions()
+*    ExecuteInstructionsSwitch()
 *
-*    Runs the currenty loaded script for a given timeslice duration.
+*    Runs the currenty loaded script for a given timeslice duration, or for at most
+*    iInstrBudget instructions.
 */
 
-static void ExecuteInstructions(script_env *sc, int iTimesliceDur)
+static void ExecuteInstructionsSwitch(script_env *sc, int iTimesliceDur, int iInstrBudget)
 {
     int iExitExecLoop = FALSE;
 
-    // Create a variable to hold the time at which the main timeslice started
-
-    int iMainTimesliceStartTime = GetCurrTime();
-
-    // Create a variable to hold the current time
-    int iCurrTime;
+    // 时间片结束的时刻。时钟每TIMESLICE_CHECK_INTERVAL条指令才读取一次
+    int iHasTimeslice = (iTimesliceDur != POLY_INFINITE_TIMESLICE);
+    int iTimesliceEndTime = iHasTimeslice ? GetCurrTime() + iTimesliceDur : 0;
+    int iClockCountdown = TIMESLICE_CHECK_INTERVAL;
 
     // Execution loop
     while (sc->IsRunning)
     {
         // 检查线程是否已经终结，则退出执行循环
 
-        // Update the current time
-        iCurrTime = GetCurrTime();
-
-        // Is the script currently paused?
+        // 脚本暂停时立即返回宿主，由宿主决定何时再运行它
         if (sc->IsPaused)
-        {
-            // Has the pause duration elapsed yet?
-            if (iCurrTime < sc->PauseEndTime)
-                continue;
-            sc->IsPaused = FALSE;
-        }
+            break;
 
         // 如果没有任何指令需要执行，则停止运行
         if (sc->CurrInstr >= sc->InstrStream.Size)
@@ -719,9 +1068,15 @@ static void ExecuteInstructions(script_env *sc, int iTimesliceDur)
             break;
         }
 
+        // 指令预算用尽
+        if (iInstrBudget != INFINITE_INSTR_BUDGET && iInstrBudget-- == 0)
+            break;
+
         // 保存指令指针，用于之后的比较
         int iCurrInstr = sc->CurrInstr;
 
+        ++sc->InstrCount;
+
         // Get the current opcode
         int iOpcode = sc->InstrStream.Instrs[iCurrInstr].Opcode;
 
@@ -747,6 +1102,7 @@ static void ExecuteInstructions(script_env *sc, int iTimesliceDur)
             PolyObject op1 = exec_pop(sc);
             PolyObject op0 = exec_pop(sc);
             PolyObject op2;
+            op2.Type = OP_TYPE_NULL;
 
             switch (iOpcode)
             {
@@ -795,11 +1151,17 @@ static void ExecuteInstructions(script_env *sc, int iTimesliceDur)
                 break;
             }
 
-            // 保存计算结果
+            // 保存计算结果。exec_push()另外增加了引用，拼接出的新字符串只属于栈槽
             exec_push(sc, &op2);
+            if (op2.Type == OP_TYPE_STRING)
+                Str_Release(op2.String);
             break;
         }
 
+        case INSTR_ADDN:
+            exec_addn(sc, ResolveOpAsInt(sc, 0));
+            break;
+
             // Move
 
         case INSTR_MOV:
@@ -886,8 +1248,10 @@ static void ExecuteInstructions(script_env *sc, int iTimesliceDur)
         case INSTR_JGE:
         case INSTR_JLE:
         {
-            PolyObject *Op1 = &exec_pop(sc); // 条件2
-            PolyObject *Op0 = &exec_pop(sc); // 条件1
+            PolyObject Cond1 = exec_pop(sc); // 条件2
+            PolyObject Cond0 = exec_pop(sc); // 条件1
+            PolyObject *Op1 = &Cond1;
+            PolyObject *Op0 = &Cond0;
 
             // Get the index of the target instruction (opcode index 2)
 
@@ -915,7 +1279,7 @@ static void ExecuteInstructions(script_env *sc, int iTimesliceDur)
                     break;
 
                 case OP_TYPE_STRING:
-                    if (strcmp(Op0->String, Op1->String) == 0)
+                    if (Str_Equal(Op0->String, Op1->String))
                         iJump = TRUE;
                     break;
                 }
@@ -938,7 +1302,7 @@ static void ExecuteInstructions(script_env *sc, int iTimesliceDur)
                     break;
 
                 case OP_TYPE_STRING:
-                    if (strcmp(Op0->String, Op1->String) != 0)
+                    if (!Str_Equal(Op0->String, Op1->String))
                         iJump = TRUE;
                     break;
                 }
@@ -1019,7 +1383,8 @@ static void ExecuteInstructions(script_env *sc, int iTimesliceDur)
 
         case INSTR_BRTRUE:
         {
-            PolyObject *Op0 = &exec_pop(sc); // 条件
+            PolyObject Cond = exec_pop(sc); // 条件
+            PolyObject *Op0 = &Cond;
 
             // Get the index of the target instruction (opcode index 2)
 
@@ -1055,7 +1420,8 @@ static void ExecuteInstructions(script_env *sc, int iTimesliceDur)
         }
         case INSTR_BRFALSE:
         {
-            PolyObject *Op0 = &exec_pop(sc); // 条件
+            PolyObject Cond = exec_pop(sc); // 条件
+            PolyObject *Op0 = &Cond;
 
             // Get the index of the target instruction (opcode index 2)
 
@@ -1105,7 +1471,8 @@ static void ExecuteInstructions(script_env *sc, int iTimesliceDur)
         case INSTR_POP:
         {
             // Pop the top of the stack into the destination
-            *ResolveOpValue(sc, 0) = exec_pop(sc);
+            PolyObject Val = exec_pop(sc);
+            CopyValue(ResolveOpValue(sc, 0), &Val);
             break;
         }
 
@@ -1181,51 +1548,8 @@ static void ExecuteInstructions(script_env *sc, int iTimesliceDur)
 
             // 调用宿主函数
             case OP_TYPE_HOST_CALL_INDEX:
-            {
-                // Use operand zero to index into the host API call table and get the
-                // host API function name
-
-                int iHostAPICallIndex = oprand->HostFuncIndex;
-
-                // Get the name of the host API function
-
-                char *pstrFuncName = GetHostFunc(sc, iHostAPICallIndex);
-
-                // Search through the host API until the matching function is found
-
-                int iMatchFound = FALSE;
-                HOST_API_FUNC *pCFunction = g_HostAPIs;
-                while (pCFunction)
-                {
-                    // Get a pointer to the name of the current host API function
-
-                    char *pstrCurrHostAPIFunc = pCFunction->Name;
-
-                    // If it equals the requested name, it might be a match
-
-                    if (strcmp(pstrFuncName, pstrCurrHostAPIFunc) == 0)
-                    {
-                        iMatchFound = TRUE;
-                        break;
-                    }
-                    pCFunction = pCFunction->Next;
-                }
-
-                // If a match was found, call the host API funcfion and pass the current
-                // thread index
-
-                if (iMatchFound)
-                {
-                    pCFunction->FuncPtr(sc);
-                }
-                else
-                {
-                    fprintf(stderr, "VM: 调用未定义的函数 '%s'\n", pstrFuncName);
-                    exit(1);
-                }
-            }
-
-            break;
+                CallHostFunc(sc, oprand->HostFuncIndex, oprand->OffsetIndex);
+                break;
             }
         }
 
@@ -1240,15 +1564,36 @@ static void ExecuteInstructions(script_env *sc, int iTimesliceDur)
             assert(FuncIndex.Type == OP_TYPE_FUNC_INDEX ||
                    FuncIndex.Type == OP_TYPE_STACK_BASE_MARKER);
 
+            // 如果是主函数返回，记录退出代码
+            if (sc->IsMainFuncPresent &&
+                sc->MainFuncIndex == FuncIndex.FuncIndex)
+            {
+                sc->ExitCode = sc->_RetVal.Fixnum;
+            }
+
+            // 批量调用的下一行：栈帧和函数信息块留在原处，从入口重新执行。
+            // 入口可能就是这条RET，所以直接进入下一次循环，不递增指令指针
+            if (FuncIndex.Type == OP_TYPE_STACK_BASE_MARKER && sc->Batch)
+            {
+                int iEntryPoint = NextBatchRow(sc);
+                if (iEntryPoint >= 0)
+                {
+                    ++sc->iTopIndex;
+                    sc->CurrInstr = iEntryPoint;
+                    continue;
+                }
+            }
+
             // Check for the presence of a stack base marker
             if (FuncIndex.Type == OP_TYPE_STACK_BASE_MARKER)
                 iExitExecLoop = TRUE;
 
-            // 如果是主函数返回，记录退出代码
-            if (sc->IsMainFuncPresent &&
+            // 由Poly_RunScript()调用的Main()返回，脚本结束
+            if (FuncIndex.Type == OP_TYPE_STACK_BASE_MARKER && sc->IsMainActive &&
                 sc->MainFuncIndex == FuncIndex.FuncIndex)
             {
-                sc->ExitCode = sc->_RetVal.Fixnum;
+                sc->IsMainActive = FALSE;
+                sc->IsRunning = FALSE;
             }
 
             // Get the previous function index
@@ -1264,6 +1609,9 @@ static void ExecuteInstructions(script_env *sc, int iTimesliceDur)
             // Pop the stack frame along with the return address
             PopFrame(sc, CurrFunc->StackFrameSize);
 
+            // 恢复调用者的栈帧
+            sc->iFrameIndex = FuncIndex.OffsetIndex;
+
             // Make the jump to the return address
             sc->CurrInstr = ReturnAddr->InstrIndex;
 
@@ -1278,18 +1626,15 @@ static void ExecuteInstructions(script_env *sc, int iTimesliceDur)
         }
 
         case INSTR_BREAK:
-            // 暂停虚拟机
+            // 暂停虚拟机，返回宿主。下一次运行时立即恢复
             sc->IsPaused = TRUE;
+            sc->PauseEndTime = GetCurrTime();
             // TODO 调用调试例程
             break;
 
         case INSTR_NEW:
         {
-            int iSize = ResolveOpAsInt(sc, 0);
-            if (sc->iMaxObjects)
-                RunGC(sc);
-            PolyObject val = GC_AllocObject(iSize, &sc->pLastObject);
-            sc->iNumberOfObjects++;
+            PolyObject val = NewObject(sc, ResolveOpAsInt(sc, 0));
             exec_push(sc, &val);
             break;
         }
@@ -1298,6 +1643,13 @@ static void ExecuteInstructions(script_env *sc, int iTimesliceDur)
             // 空指令，消耗一个指令周期
             break;
 
+        case INSTR_HALT:
+            // 指令流末尾的哨兵
+            sc->IsRunning = FALSE;
+            sc->ExitCode = EXIT_SUCCESS;
+            iExitExecLoop = TRUE;
+            break;
+
         case INSTR_PAUSE:
         {
             // Get the pause duration
@@ -1306,7 +1658,7 @@ static void ExecuteInstructions(script_env *sc, int iTimesliceDur)
 
             // Determine the ending pause time
 
-            sc->PauseEndTime = iCurrTime + iPauseDuration;
+            sc->PauseEndTime = GetCurrTime() + iPauseDuration;
 
             // Pause the script
 
@@ -1326,9 +1678,12 @@ static void ExecuteInstructions(script_env *sc, int iTimesliceDur)
             ++sc->CurrInstr;
 
         // 线程耗尽时间片
-        if (iTimesliceDur != POLY_INFINITE_TIMESLICE)
-            if (iCurrTime > iMainTimesliceStartTime + iTimesliceDur)
+        if (iHasTimeslice && --iClockCountdown == 0)
+        {
+            iClockCountdown = TIMESLICE_CHECK_INTERVAL;
+            if (GetCurrTime() > iTimesliceEndTime)
                 break;
+        }
 
         // Exit the execution loop if the script has terminated
         if (iExitExecLoop)
@@ -1338,30 +1693,152 @@ static void ExecuteInstructions(script_env *sc, int iTimesliceDur)
 
 /******************************************************************************************
 *
-*    Poly_RunScript()
+*    ExecuteInstructions()
 *
-*    Runs the specified script from Main() for a given timeslice duration.
+*    Runs the currenty loaded script with the selected dispatch engine.
 */
 
-void Poly_RunScript(script_env *sc, int iTimesliceDur)
+static void ExecuteInstructions(script_env *sc, int iTimesliceDur, int iInstrBudget)
 {
-    Poly_StartScript(sc);
-    if (Poly_CallScriptFunc(sc, "Main") == FALSE)
-        fprintf(stderr, "VM ERROR: Main() Function Not Found.\n");
+    // 宿主在脚本之外转换的返回值到此失效。宿主函数中同步调用脚本时外层的转换结果仍在使用
+    if (!sc->HostCallDepth)
+        ReleaseCoercions(sc, 0, NULL);
+
+    if (sc->Engine == POLY_ENGINE_SWITCH)
+        ExecuteInstructionsSwitch(sc, iTimesliceDur, iInstrBudget);
+    else
+        ExecuteInstructionsThreaded(sc, iTimesliceDur, iInstrBudget);
 }
 
 /******************************************************************************************
 *
-*	Poly_StartScript()
+*    WakeScript()
 *
-*   Starts the execution of a script.
+*    Clears the paused state of a script whose pause has elapsed. Returns FALSE if the
+*    script is still sleeping.
 */
 
-void Poly_StartScript(script_env *sc)
+static int WakeScript(script_env *sc)
 {
-    sc->IsRunning = TRUE;
-    sc->ThreadActiveTime = GetCurrTime();
-}
+    if (!sc->IsPaused)
+        return TRUE;
+
+    if (GetCurrTime() < sc->PauseEndTime)
+        return FALSE;
+
+    sc->IsPaused = FALSE;
+    return TRUE;
+}
+
+/******************************************************************************************
+*
+*    SleepUntil()
+*
+*    Blocks the calling thread until the given time.
+*/
+
+static void SleepUntil(int iWakeTime)
+{
+    int iDur = iWakeTime - GetCurrTime();
+    if (iDur <= 0)
+        return;
+
+#if defined(WIN32)
+    Sleep(iDur);
+#else
+    struct timespec ts;
+    ts.tv_sec = iDur / 1000;
+    ts.tv_nsec = (iDur % 1000) * 1000000L;
+    nanosleep(&ts, NULL);
+#endif
+}
+
+/******************************************************************************************
+*
+*    EnterMain()
+*
+*    Calls Main() unless it is already running, so that the script can be resumed where
+*    the last timeslice left it. Returns FALSE if there is no Main().
+*/
+
+static int EnterMain(script_env *sc)
+{
+    // 仍在睡眠的脚本不执行任何指令
+    if (!WakeScript(sc))
+        return FALSE;
+
+    if (sc->IsRunning && sc->IsMainActive)
+        return TRUE;
+
+    int iFuncIndex = GetFuncIndexByName(sc, "Main");
+    if (iFuncIndex == -1)
+    {
+        fprintf(stderr, "VM ERROR: Main() Function Not Found.\n");
+        return FALSE;
+    }
+
+    // 丢弃上一次运行留下的栈帧，只保留全局变量
+    sc->iTopIndex = sc->GlobalDataSize;
+    sc->iFrameIndex = sc->GlobalDataSize;
+
+    Poly_StartScript(sc);
+    CallFunc(sc, iFuncIndex, OP_TYPE_STACK_BASE_MARKER);
+    sc->IsMainActive = TRUE;
+
+    return TRUE;
+}
+
+/******************************************************************************************
+*
+*    Poly_RunScript()
+*
+*    Runs the specified script from Main() for a given timeslice duration. A script whose
+*    timeslice ran out is resumed where it stopped; once Main() returns, the script stops
+*    and the next call starts it over. A script that executes PAUSE returns right away,
+*    and calls made before its wake-up time (see Poly_GetNextWakeTime()) do nothing.
+*/
+
+void Poly_RunScript(script_env *sc, int iTimesliceDur)
+{
+    if (EnterMain(sc))
+        ExecuteInstructions(sc, iTimesliceDur, INFINITE_INSTR_BUDGET);
+
+    if (sc->GCTimeslice && sc->Heap.Phase != GC_PHASE_IDLE)
+        Poly_GCStep(sc, sc->GCTimeslice);
+}
+
+/******************************************************************************************
+*
+*    Poly_RunScriptInstructions()
+*
+*    Like Poly_RunScript(), but runs the script for a fixed number of instructions instead
+*    of a wall-clock timeslice, so the clock is never read.
+*/
+
+void Poly_RunScriptInstructions(script_env *sc, int iInstrBudget)
+{
+    if (iInstrBudget <= 0)
+        return;
+
+    if (EnterMain(sc))
+        ExecuteInstructions(sc, POLY_INFINITE_TIMESLICE, iInstrBudget);
+
+    if (sc->GCTimeslice && sc->Heap.Phase != GC_PHASE_IDLE)
+        Poly_GCStep(sc, sc->GCTimeslice);
+}
+
+/******************************************************************************************
+*
+*	Poly_StartScript()
+*
+*   Starts the execution of a script.
+*/
+
+void Poly_StartScript(script_env *sc)
+{
+    sc->IsRunning = TRUE;
+    sc->ThreadActiveTime = GetCurrTime();
+}
 
 /******************************************************************************************
 *
@@ -1388,6 +1865,31 @@ void Poly_PauseScript(script_env *sc, int iDur)
     sc->PauseEndTime = GetCurrTime() + iDur;
 }
 
+/******************************************************************************************
+*
+*  Poly_GetNextWakeTime()
+*
+*  Returns the time, on the Poly_GetCurrTime() clock, at which a paused script wants to
+*  run again. A script that isn't paused can run now, so the current time is returned.
+*/
+
+int Poly_GetNextWakeTime(script_env *sc)
+{
+    return sc->IsPaused ? sc->PauseEndTime : GetCurrTime();
+}
+
+/******************************************************************************************
+*
+*  Poly_GetCurrTime()
+*
+*  Returns the VM clock in milliseconds, the clock used for pauses and timeslices.
+*/
+
+int Poly_GetCurrTime()
+{
+    return GetCurrTime();
+}
+
 /******************************************************************************************
 *
 *  Poly_ResumeScript()
@@ -1442,35 +1944,278 @@ char *Poly_GetReturnValueAsString(script_env *sc)
     return sc->_RetVal.String;
 }
 
-static void MarkAll(script_env *pScript)
+/******************************************************************************************
+*
+*    Poly_GetReturnValueAsStringView()
+*
+*    Returns the last returned value as a borrowed string, converting numbers. The view is
+*    valid until the script runs again.
+*/
+
+POLY_STRING_VIEW Poly_GetReturnValueAsStringView(script_env *sc)
+{
+    return GetValueAsStringView(sc, &sc->_RetVal);
+}
+
+/******************************************************************************************
+*
+*    CollectNursery()
+*
+*    Minor collection: moves the young objects reachable from the stack, the register and
+*    the remembered set to the old generation and empties the nursery.
+*/
+
+static void CollectNursery(script_env *sc)
+{
+    if (!sc->Heap.YoungCount)
+        return;
+
+    for (int i = 0; i < sc->iTopIndex; i++)
+        GC_Promote(&sc->Heap, &sc->stack[i]);
+    GC_Promote(&sc->Heap, &sc->_RetVal);
+
+    for (HOST_BATCH *pBatch = sc->Batch; pBatch; pBatch = pBatch->Prev)
+    {
+        for (int i = 0; pBatch->Results && i < pBatch->Row; i++)
+            GC_Promote(&sc->Heap, &pBatch->Results[i]);
+    }
+
+    GC_FinishMinor(&sc->Heap);
+}
+
+static void MarkRoots(script_env *pScript)
 {
     // 标记堆栈
     for (int i = 0; i < pScript->iTopIndex; i++)
     {
-        GC_Mark(pScript->stack[i]);
+        GC_Mark(&pScript->Heap, pScript->stack[i]);
     }
 
     // 标记寄存器
-    GC_Mark(pScript->_RetVal);
+    GC_Mark(&pScript->Heap, pScript->_RetVal);
+
+    // 标记批量调用已经返回的结果
+    for (HOST_BATCH *pBatch = pScript->Batch; pBatch; pBatch = pBatch->Prev)
+    {
+        for (int i = 0; pBatch->Results && i < pBatch->Row; i++)
+            GC_Mark(&pScript->Heap, pBatch->Results[i]);
+    }
 }
 
-static void RunGC(script_env *pScript)
+// 开始一轮老年代回收。标记-清除只处理老年代，先清空新生代
+static void StartCycle(script_env *sc)
 {
-    int numObjects = pScript->iNumberOfObjects;
+    CollectNursery(sc);
+    sc->Heap.Phase = GC_PHASE_MARK;
+    sc->GCNextStep = sc->Heap.Stats.BytesAllocated + GC_STEP_BYTES;
+    MarkRoots(sc);
+}
 
-    // mark all reachable objects
-    MarkAll(pScript);
+// 按存活的字节数调整回收临界上限
+static void SetThreshold(script_env *sc)
+{
+    sc->GCThreshold = (size_t)((unsigned long long)sc->Heap.Stats.LiveBytes * sc->GCGrowth / 100);
+    if (sc->GCThreshold < sc->GCMinThreshold)
+        sc->GCThreshold = sc->GCMinThreshold;
+}
 
-    // 清除对象
-    pScript->iNumberOfObjects -= GC_Sweep(&pScript->pLastObject);
+// 记录一次回收造成的暂停
+static void EndPause(script_env *sc, std::chrono::steady_clock::time_point Start)
+{
+    POLY_GC_STATS *pStats = &sc->Heap.Stats;
+    unsigned int iPauseUs = (unsigned int)std::chrono::duration_cast<std::chrono::microseconds>(
+                                std::chrono::steady_clock::now() - Start).count();
+
+    pStats->Pauses++;
+    pStats->TotalPauseUs += iPauseUs;
+    if (iPauseUs > pStats->MaxPauseUs)
+        pStats->MaxPauseUs = iPauseUs;
+}
 
-    // 调整回收临界上限
-    pScript->iMaxObjects = pScript->iNumberOfObjects * 2;
+/******************************************************************************************
+*
+*    CollectStep()
+*
+*    Advances the current collection by at most iWork units (objects scanned or swept).
+*    Returns TRUE once no collection is in progress.
+*/
 
-#if 1
-    printf("Collected %d objects, %d remaining.\n", numObjects - pScript->iNumberOfObjects,
-           pScript->iNumberOfObjects);
-#endif
+static int CollectStep(script_env *sc, int iWork)
+{
+    GC_HEAP *pHeap = &sc->Heap;
+
+    if (pHeap->Phase == GC_PHASE_MARK)
+    {
+        if (!GC_MarkStep(pHeap, &iWork))
+            return FALSE;
+
+        // 栈和寄存器没有写屏障，标记期间新生代对象也没有标记，在这里一次完成：
+        // 晋升的对象是灰色的，和重新标记的根一起扫描
+        CollectNursery(sc);
+        MarkRoots(sc);
+        GC_Trace(pHeap);
+        GC_StartSweep(pHeap);
+    }
+
+    if (pHeap->Phase == GC_PHASE_SWEEP)
+    {
+        if (!GC_SweepStep(pHeap, &iWork))
+            return FALSE;
+
+        SetThreshold(sc);
+    }
+
+    return TRUE;
+}
+
+/******************************************************************************************
+*
+*    RunGC()
+*
+*    Collects the whole heap at once, finishing a collection in progress first.
+*/
+
+void RunGC(script_env *pScript)
+{
+    std::chrono::steady_clock::time_point Start = std::chrono::steady_clock::now();
+
+    if (pScript->Heap.Phase != GC_PHASE_IDLE)
+        CollectStep(pScript, INT_MAX);
+
+    StartCycle(pScript);
+    CollectStep(pScript, INT_MAX);
+
+    EndPause(pScript, Start);
+}
+
+/******************************************************************************************
+*
+*    Poly_GCStep()
+*
+*    Advances the collection of the old generation for about iMicroseconds, starting one
+*    if objects were promoted since the last. Hosts can call it in idle time, e.g. at the
+*    end of a frame. Returns TRUE if no collection is left in progress.
+*/
+
+int Poly_GCStep(script_env *sc, int iMicroseconds)
+{
+    if (sc->Heap.Phase == GC_PHASE_IDLE && sc->Heap.OldBytes <= sc->Heap.Stats.LiveBytes)
+        return TRUE;
+
+    std::chrono::steady_clock::time_point Start = std::chrono::steady_clock::now();
+    std::chrono::steady_clock::time_point End = Start + std::chrono::microseconds(iMicroseconds);
+    int iDone;
+
+    if (sc->Heap.Phase == GC_PHASE_IDLE)
+        StartCycle(sc);
+
+    // 每做GC_STEP_WORK个单位的工作读一次时钟，至少做一次
+    do
+    {
+        iDone = CollectStep(sc, GC_STEP_WORK);
+    } while (!iDone && std::chrono::steady_clock::now() < End);
+
+    EndPause(sc, Start);
+    return iDone;
+}
+
+/******************************************************************************************
+*
+*    Poly_SetGCTimeslice()
+*
+*    Sets how long Poly_RunScript() and Poly_RunScriptInstructions() spend advancing a
+*    collection in progress after running the script. 0 (the default) leaves the pace
+*    to allocation and Poly_GCStep().
+*/
+
+void Poly_SetGCTimeslice(script_env *sc, int iMicroseconds)
+{
+    sc->GCTimeslice = iMicroseconds > 0 ? iMicroseconds : 0;
+}
+
+/******************************************************************************************
+*
+*    Poly_SetGCParams()
+*
+*    Sets how the collection of the old generation is paced: after each collection it
+*    starts again once the old generation holds iGrowthPercent% of the bytes that survived,
+*    but never below iMinThreshold bytes. 0 selects the default for either value.
+*/
+
+void Poly_SetGCParams(script_env *sc, int iGrowthPercent, size_t iMinThreshold)
+{
+    if (iGrowthPercent <= 0)
+        iGrowthPercent = GC_DEFAULT_GROWTH;
+    else if (iGrowthPercent < GC_MIN_GROWTH)
+        iGrowthPercent = GC_MIN_GROWTH;
+
+    sc->GCGrowth = iGrowthPercent;
+    sc->GCMinThreshold = iMinThreshold ? iMinThreshold : INITIAL_GC_THRESHOLD;
+    SetThreshold(sc);
+}
+
+/******************************************************************************************
+*
+*    Poly_GetGCStats()
+*
+*    Fills pStats with the collector statistics of the script since it was created.
+*/
+
+void Poly_GetGCStats(script_env *sc, POLY_GC_STATS *pStats)
+{
+    *pStats = sc->Heap.Stats;
+    pStats->HeapBytes = sc->Heap.OldBytes + sc->Heap.NurseryBytes;
+}
+
+/******************************************************************************************
+*
+*    NewObject()
+*
+*    Allocates an object with iSize fields for INSTR_NEW and Poly_NewObject(). A full
+*    nursery is collected first. A collection of the old generation starts once it holds
+*    GCThreshold bytes and is advanced every GC_STEP_BYTES allocated, so it always ends;
+*    if the old generation still doubles in the meantime, the collection is finished at
+*    once.
+*/
+
+static void PaceCollection(script_env *sc, int iSize)
+{
+    GC_HEAP *pHeap = &sc->Heap;
+    std::chrono::steady_clock::time_point Start = std::chrono::steady_clock::now();
+
+    if (!GC_NurseryHasRoom(pHeap, iSize))
+        CollectNursery(sc);
+
+    if (pHeap->Phase == GC_PHASE_IDLE)
+    {
+        if (pHeap->OldBytes >= sc->GCThreshold)
+            StartCycle(sc);
+    }
+    else if (pHeap->Stats.BytesAllocated >= sc->GCNextStep)
+    {
+        if (pHeap->OldBytes >= sc->GCThreshold * 2)
+            CollectStep(sc, INT_MAX);
+        else
+            CollectStep(sc, GC_STEP_WORK);
+        sc->GCNextStep = pHeap->Stats.BytesAllocated + GC_STEP_BYTES;
+    }
+
+    EndPause(sc, Start);
+}
+
+PolyObject NewObject(script_env *sc, int iSize)
+{
+    GC_HEAP *pHeap = &sc->Heap;
+
+    // 只有需要回收时才读时钟
+    if (!GC_NurseryHasRoom(pHeap, iSize) ||
+        (pHeap->Phase == GC_PHASE_IDLE ? pHeap->OldBytes >= sc->GCThreshold
+                                       : pHeap->Stats.BytesAllocated >= sc->GCNextStep))
+    {
+        PaceCollection(sc, iSize);
+    }
+
+    return GC_AllocObject(pHeap, iSize);
 }
 
 /******************************************************************************************
@@ -1543,34 +2288,83 @@ float CoerceValueToFloat(PolyObject *Val)
     }
 }
 
+/******************************************************************************************
+*
+*  ReleaseCoercions()
+*
+*  Reclaims the scratch area above iTop and frees the overflow blocks allocated after
+*  pKeep.
+*/
+
+// 暂存区用完后，一个转换结果占用一个溢出块
+struct COERCION_BLOCK
+{
+    COERCION_BLOCK *Next;
+    char Chars[STR_NUMBER_SIZE];
+};
+
+static void ReleaseCoercions(script_env *sc, int iTop, COERCION_BLOCK *pKeep)
+{
+    while (sc->CoercionOverflow != pKeep)
+    {
+        COERCION_BLOCK *pNext = sc->CoercionOverflow->Next;
+        free(sc->CoercionOverflow);
+        sc->CoercionOverflow = pNext;
+    }
+
+    sc->CoercionTop = iTop;
+}
+
 /******************************************************************************************
 *
 *  CoereceValueToString()
 *
-*  Coerces a Value structure from it's current type to a string value.
+*  Coerces a Value structure from it's current type to a string value. Numbers are
+*  formatted into the script's scratch area, or into an overflow block once it is full.
+*  The result stays valid until the current host function returns; outside host
+*  functions, until the script runs again.
 */
 
-char *CoerceValueToString(PolyObject *Val)
+char *CoerceValueToString(script_env *sc, PolyObject *Val)
 {
     char *pstrCoercion;
+    int iInScratch;
 
     // Determine which type the Value currently is
 
     switch (Val->Type)
     {
-        // It's an integer, so convert it to a string
+        // It's a number, so format it into the scratch area
 
     case OP_TYPE_INT:
-        pstrCoercion = (char *)malloc(MAX_COERCION_STRING_SIZE + 1);
-        sprintf(pstrCoercion, "%d", Val->Fixnum);
-        return pstrCoercion;
+    case OP_TYPE_FLOAT:
+        // 暂存区已满时不能回绕，之前的结果可能仍在使用
+        iInScratch = (sc->CoercionTop + STR_NUMBER_SIZE <= COERCION_SCRATCH_SIZE);
+        if (iInScratch)
+        {
+            pstrCoercion = &sc->CoercionScratch[sc->CoercionTop];
+        }
+        else
+        {
+            COERCION_BLOCK *pBlock = (COERCION_BLOCK *)malloc(sizeof(COERCION_BLOCK));
+            if (!pBlock)
+            {
+                fprintf(stderr, "VM: 内存不足\n");
+                exit(1);
+            }
+            pBlock->Next = sc->CoercionOverflow;
+            sc->CoercionOverflow = pBlock;
+            pstrCoercion = pBlock->Chars;
+        }
 
-        // It's a float, so use sprintf() to convert it since there's no built-in function
-        // for converting floats to strings
+        int iLength;
+        if (Val->Type == OP_TYPE_INT)
+            iLength = Str_FormatInt(Val->Fixnum, pstrCoercion);
+        else
+            iLength = Str_FormatFloat(Val->Realnum, pstrCoercion);
 
-    case OP_TYPE_FLOAT:
-        pstrCoercion = (char *)malloc(MAX_COERCION_STRING_SIZE + 1);
-        sprintf(pstrCoercion, "%f", Val->Realnum);
+        if (iInScratch)
+            sc->CoercionTop += iLength + 1;
         return pstrCoercion;
 
         // It's a string, so return it as-is
@@ -1585,6 +2379,40 @@ char *CoerceValueToString(PolyObject *Val)
     }
 }
 
+/******************************************************************************************
+*
+*  GetValueAsStringView()
+*
+*  Returns a value as a borrowed string. Strings know their length; numbers are coerced
+*  into the scratch area. Anything else is the empty string.
+*/
+
+static POLY_STRING_VIEW GetValueAsStringView(script_env *sc, PolyObject *Val)
+{
+    POLY_STRING_VIEW View;
+
+    switch (Val->Type)
+    {
+    case OP_TYPE_STRING:
+        View.Chars = Val->String;
+        View.Length = Str_Length(Val->String);
+        break;
+
+    case OP_TYPE_INT:
+    case OP_TYPE_FLOAT:
+        View.Chars = CoerceValueToString(sc, Val);
+        View.Length = strlen(View.Chars);
+        break;
+
+    default:
+        View.Chars = "";
+        View.Length = 0;
+        break;
+    }
+
+    return View;
+}
+
 /******************************************************************************************
 *
 *    GetOpType()
@@ -1720,7 +2548,7 @@ inline char *ResolveOpAsString(script_env *sc, int iOpIndex)
 
     // Coerce it to a string and return it
 
-    char *pstrString = CoerceValueToString(OpValue);
+    char *pstrString = CoerceValueToString(sc, OpValue);
     return pstrString;
 }
 
@@ -1812,12 +2640,60 @@ inline void SetStackValue(script_env *sc, int iIndex, PolyObject Val)
 
 /******************************************************************************************
 *
-*    PushFrame()
+*    GrowStack()
 *
-*    Pushes a stack frame.
+*    Makes room for iCount more values above the top of the stack by moving it to a larger
+*    block. The stack is addressed by index, so nothing refers to the old block. A script
+*    that would need more than MAX_STACK_SIZE values is stopped. Returns FALSE if the stack
+*    couldn't grow.
 */
 
-inline void PushFrame(script_env *sc, int iSize)
+int GrowStack(script_env *sc, int iCount)
+{
+    int iNeeded = sc->iTopIndex + iCount;
+    if (iNeeded <= sc->iStackSize)
+        return TRUE;
+
+    if (iNeeded > MAX_STACK_SIZE)
+    {
+        fprintf(stderr, "VM ERROR: Stack Overflow.\n");
+        sc->IsRunning = FALSE;
+        sc->ExitCode = EXIT_FAILURE;
+        return FALSE;
+    }
+
+    // 按倍数增长，摊还后每次压栈的开销不变
+    int iNewSize = sc->iStackSize * 2;
+    if (iNewSize < iNeeded)
+        iNewSize = iNeeded;
+    if (iNewSize > MAX_STACK_SIZE)
+        iNewSize = MAX_STACK_SIZE;
+
+    PolyObject *pStack = (PolyObject *)realloc(sc->stack, iNewSize * sizeof(PolyObject));
+    if (!pStack)
+    {
+        fprintf(stderr, "VM ERROR: Out Of Memory.\n");
+        sc->IsRunning = FALSE;
+        sc->ExitCode = EXIT_FAILURE;
+        return FALSE;
+    }
+
+    for (int i = sc->iStackSize; i < iNewSize; ++i)
+        pStack[i].Type = OP_TYPE_NULL;
+
+    sc->stack = pStack;
+    sc->iStackSize = iNewSize;
+    return TRUE;
+}
+
+/******************************************************************************************
+*
+*    PushFrame()
+*
+*    Pushes a stack frame.
+*/
+
+inline void PushFrame(script_env *sc, int iSize)
 {
     // Increment the top index by the size of the frame
 
@@ -1866,6 +2742,223 @@ inline char *GetHostFunc(script_env *sc, int iIndex)
     return sc->HostCallTable.Calls[iIndex];
 }
 
+/******************************************************************************************
+*
+*    ResetHostBindings()
+*
+*    Clears the host call bindings of a script, allocating the table on first use.
+*/
+
+static void ResetHostBindings(script_env *sc)
+{
+    if (!sc->HostBindings)
+    {
+        sc->HostBindings = (HOST_API_FUNC **)malloc(sc->HostCallTable.Size * sizeof(HOST_API_FUNC *));
+        if (!sc->HostBindings)
+        {
+            fprintf(stderr, "VM: 内存不足\n");
+            exit(1);
+        }
+    }
+
+    memset(sc->HostBindings, 0, sc->HostCallTable.Size * sizeof(HOST_API_FUNC *));
+    sc->HostBindingEpoch = g_HostAPIEpoch;
+}
+
+/******************************************************************************************
+*
+*    BindHostFunc()
+*
+*    Resolves a host call by name, script-specific functions first, then the global ones,
+*    and caches the result in the binding table.
+*/
+
+static HOST_API_FUNC *BindHostFunc(script_env *sc, int iHostFuncIndex)
+{
+    char *pstrFuncName = GetHostFunc(sc, iHostFuncIndex);
+
+    HOST_API_FUNC *pCFunction = sc->HostAPIs;
+    while (pCFunction && strcmp(pstrFuncName, pCFunction->Name) != 0)
+        pCFunction = pCFunction->Next;
+
+    if (!pCFunction)
+    {
+        pCFunction = g_HostAPIs;
+        while (pCFunction && strcmp(pstrFuncName, pCFunction->Name) != 0)
+            pCFunction = pCFunction->Next;
+    }
+
+    if (!pCFunction)
+    {
+        fprintf(stderr, "VM: 调用未定义的函数 '%s'\n", pstrFuncName);
+        exit(1);
+    }
+
+    sc->HostBindings[iHostFuncIndex] = pCFunction;
+    return pCFunction;
+}
+
+/******************************************************************************************
+*
+*    GetHostArgAsInt(), GetHostArgAsFloat(), GetHostArgAsString()
+*
+*    Convert a host call argument to the native type of a typed host function. Strings are
+*    passed in place; numbers are formatted into the caller's buffer.
+*/
+
+static inline int GetHostArgAsInt(PolyObject *pArg)
+{
+    if (pArg->Type == OP_TYPE_INT)
+        return pArg->Fixnum;
+    return CoerceValueToInt(pArg);
+}
+
+static inline float GetHostArgAsFloat(PolyObject *pArg)
+{
+    if (pArg->Type == OP_TYPE_FLOAT)
+        return pArg->Realnum;
+    return CoerceValueToFloat(pArg);
+}
+
+static const char *GetHostArgAsString(PolyObject *pArg, char *pstrBuffer)
+{
+    switch (pArg->Type)
+    {
+    case OP_TYPE_STRING:
+        return pArg->String;
+
+    case OP_TYPE_INT:
+        Str_FormatInt(pArg->Fixnum, pstrBuffer);
+        return pstrBuffer;
+
+    case OP_TYPE_FLOAT:
+        Str_FormatFloat(pArg->Realnum, pstrBuffer);
+        return pstrBuffer;
+
+    default:
+        return "";
+    }
+}
+
+/******************************************************************************************
+*
+*    CallTypedHostFunc()
+*
+*    Calls a typed host function with the arguments converted straight from the stack and
+*    stores its result in _RetVal.
+*/
+
+static void CallTypedHostFunc(script_env *sc, HOST_API_FUNC *pFunc, PolyObject *pArgs, int iArgCount)
+{
+    if (iArgCount != pFunc->ParamCount)
+    {
+        fprintf(stderr, "VM: 宿主函数 '%s' 需要%d个参数，传入了%d个\n", pFunc->Name, pFunc->ParamCount, iArgCount);
+        exit(1);
+    }
+
+    char pstrBuffer[STR_NUMBER_SIZE];
+    PolyObject RetVal;
+    RetVal.Type = OP_TYPE_NULL;
+
+    switch (pFunc->Signature)
+    {
+    case HOST_SIG_I_V:
+        ((void (*)(int))pFunc->Native)(GetHostArgAsInt(&pArgs[0]));
+        break;
+
+    case HOST_SIG_S_V:
+        ((void (*)(const char *))pFunc->Native)(GetHostArgAsString(&pArgs[0], pstrBuffer));
+        break;
+
+    case HOST_SIG_I_I:
+        RetVal.Type = OP_TYPE_INT;
+        RetVal.Fixnum = ((int (*)(int))pFunc->Native)(GetHostArgAsInt(&pArgs[0]));
+        break;
+
+    case HOST_SIG_II_I:
+        RetVal.Type = OP_TYPE_INT;
+        RetVal.Fixnum = ((int (*)(int, int))pFunc->Native)(GetHostArgAsInt(&pArgs[0]),
+                                                           GetHostArgAsInt(&pArgs[1]));
+        break;
+
+    case HOST_SIG_III_I:
+        RetVal.Type = OP_TYPE_INT;
+        RetVal.Fixnum = ((int (*)(int, int, int))pFunc->Native)(GetHostArgAsInt(&pArgs[0]),
+                                                                GetHostArgAsInt(&pArgs[1]),
+                                                                GetHostArgAsInt(&pArgs[2]));
+        break;
+
+    case HOST_SIG_S_I:
+        RetVal.Type = OP_TYPE_INT;
+        RetVal.Fixnum = ((int (*)(const char *))pFunc->Native)(GetHostArgAsString(&pArgs[0], pstrBuffer));
+        break;
+
+    case HOST_SIG_F_F:
+        RetVal.Type = OP_TYPE_FLOAT;
+        RetVal.Realnum = ((float (*)(float))pFunc->Native)(GetHostArgAsFloat(&pArgs[0]));
+        break;
+
+    case HOST_SIG_FF_F:
+        RetVal.Type = OP_TYPE_FLOAT;
+        RetVal.Realnum = ((float (*)(float, float))pFunc->Native)(GetHostArgAsFloat(&pArgs[0]),
+                                                                  GetHostArgAsFloat(&pArgs[1]));
+        break;
+    }
+
+    // 没有返回值时和Poly_ReturnFromHost()一样保留_RetVal
+    if (RetVal.Type != OP_TYPE_NULL)
+        CopyValue(&sc->_RetVal, &RetVal);
+}
+
+/******************************************************************************************
+*
+*    CallHostFunc()
+*
+*    Looks up the host API function referenced by the host API call table and calls it.
+*/
+
+void CallHostFunc(script_env *sc, int iHostFuncIndex, int iArgCount)
+{
+    // 注册过宿主函数后，之前解析的绑定全部作废
+    if (sc->HostBindingEpoch != g_HostAPIEpoch)
+        ResetHostBindings(sc);
+
+    HOST_API_FUNC *pFunc = sc->HostBindings[iHostFuncIndex];
+    if (!pFunc)
+        pFunc = BindHostFunc(sc, iHostFuncIndex);
+
+    // 实参位于栈顶，下面可能还有表达式的临时值
+    int iArgBase = sc->iTopIndex - iArgCount;
+
+    if (pFunc->Signature != HOST_SIG_GENERIC)
+    {
+        CallTypedHostFunc(sc, pFunc, &sc->stack[iArgBase], iArgCount);
+        sc->iTopIndex = iArgBase;
+        return;
+    }
+
+    // 宿主函数可能通过Poly_CallScriptFunc()间接地再次调用宿主函数
+    int iOldArgBase = sc->HostArgBase;
+    int iOldArgCount = sc->HostArgCount;
+    int iOldCoercionTop = sc->CoercionTop;
+    COERCION_BLOCK *pOldOverflow = sc->CoercionOverflow;
+    int iFrameIndex = sc->iFrameIndex;
+
+    sc->HostArgBase = iArgBase;
+    sc->HostArgCount = iArgCount;
+    sc->HostCallDepth++;
+    pFunc->FuncPtr(sc);
+    sc->HostCallDepth--;
+    sc->HostArgBase = iOldArgBase;
+    sc->HostArgCount = iOldArgCount;
+    ReleaseCoercions(sc, iOldCoercionTop, pOldOverflow);
+
+    // 清除实参。宿主函数用Poly_CallScriptFuncSync()压入了被调函数的栈帧时，
+    // 实参留在栈帧下面
+    if (sc->iFrameIndex == iFrameIndex)
+        sc->iTopIndex = iArgBase;
+}
+
 /******************************************************************************************
 *
 *  GetCurrTime()
@@ -1874,7 +2967,7 @@ inline char *GetHostFunc(script_env *sc, int iIndex)
 *  milliseconds.
 */
 
-inline int GetCurrTime()
+int GetCurrTime()
 {
     unsigned theTick;
 
@@ -1903,15 +2996,21 @@ inline int GetCurrTime()
 void CallFunc(script_env *sc, int iIndex, int type)
 {
     // Advance the instruction pointer so it points to the instruction
-    // immediately following the call
+    // immediately following the call. 宿主发起的调用(栈底标记)返回到当前指令，
+    // 被中断的脚本可以从原处继续
 
-    ++sc->CurrInstr;
+    if (type != OP_TYPE_STACK_BASE_MARKER)
+        ++sc->CurrInstr;
 
     FUNC *DestFunc = GetFunc(sc, iIndex);
 
     if (!DestFunc)
         return;
 
+    // 每次调用只检查一次栈溢出，函数体内的压栈不再检查
+    if (!EnsureStack(sc, DestFunc->MaxStackDepth))
+        return;
+
     // Save the current stack frame index
     int iFrameIndex = sc->iFrameIndex;
 
@@ -1954,7 +3053,8 @@ void Poly_PassIntParam(script_env *sc, int iInt)
     Param.Fixnum = iInt;
 
     // Push the parameter onto the stack
-    exec_push(sc, &Param);
+    if (EnsureStack(sc, 1))
+        exec_push(sc, &Param);
 }
 
 /******************************************************************************************
@@ -1972,7 +3072,8 @@ void Poly_PassFloatParam(script_env *sc, float fFloat)
     Param.Realnum = fFloat;
 
     // Push the parameter onto the stack
-    exec_push(sc, &Param);
+    if (EnsureStack(sc, 1))
+        exec_push(sc, &Param);
 }
 
 /******************************************************************************************
@@ -1983,15 +3084,75 @@ void Poly_PassFloatParam(script_env *sc, float fFloat)
 */
 
 void Poly_PassStringParam(script_env *sc, const char *pstrString)
+{
+    Poly_PassStringView(sc, pstrString, strlen(pstrString));
+}
+
+/******************************************************************************************
+*
+*  Poly_PassStringView()
+*
+*  Passes iLength characters as a string parameter. The characters are copied once, into
+*  a string of exactly that size, so the buffer needn't outlive the call.
+*/
+
+void Poly_PassStringView(script_env *sc, const char *pstrChars, size_t iLength)
 {
     // Create a Value structure to encapsulate the parameter
     PolyObject Param;
     Param.Type = OP_TYPE_STRING;
-    Param.String = (char *)malloc(strlen(pstrString) + 1);
-    strcpy(Param.String, pstrString);
+    Param.String = Str_New(pstrChars, (int)iLength);
 
     // Push the parameter onto the stack
-    exec_push(sc, &Param);
+    if (EnsureStack(sc, 1))
+        exec_push(sc, &Param);
+    Str_Release(Param.String);
+}
+
+/******************************************************************************************
+*
+*  Poly_PassStaticString()
+*
+*  Passes a string created by Poly_CreateStaticString() without copying it.
+*/
+
+void Poly_PassStaticString(script_env *sc, const char *pstrStatic)
+{
+    PolyObject Param;
+    Param.Type = OP_TYPE_STRING;
+    Param.String = (char *)pstrStatic;
+
+    if (EnsureStack(sc, 1))
+        exec_push(sc, &Param);
+}
+
+/******************************************************************************************
+*
+*  Poly_CreateStaticString()
+*
+*  Copies iLength characters into a string owned by the host. Scripts reference it by
+*  pointer, like a constant from the program's string table, so passing or returning it
+*  never copies and it isn't reference counted.
+*/
+
+const char *Poly_CreateStaticString(const char *pstrChars, size_t iLength)
+{
+    char *pstrStatic = Str_New(pstrChars, (int)iLength);
+    Str_Header(pstrStatic)->RefCount = STR_INTERNED;
+    return pstrStatic;
+}
+
+/******************************************************************************************
+*
+*  Poly_FreeStaticString()
+*
+*  Frees a string from Poly_CreateStaticString(). No script may still refer to it.
+*/
+
+void Poly_FreeStaticString(const char *pstrStatic)
+{
+    if (pstrStatic)
+        Str_FreeInterned((char *)pstrStatic);
 }
 
 /******************************************************************************************
@@ -2015,6 +3176,43 @@ int GetFuncIndexByName(script_env *sc, const char *pstrName)
     return -1;
 }
 
+/******************************************************************************************
+*
+*  RunToHostReturn()
+*
+*  Runs the script until the function called from the host returns or the script stops.
+*/
+
+static void RunToHostReturn(script_env *sc)
+{
+    // Allow the script code to execute uninterrupted until the function returns
+    ExecuteInstructions(sc, POLY_INFINITE_TIMESLICE, INFINITE_INSTR_BUDGET);
+
+    // 宿主的调用是同步的，被调函数暂停时只能在这里睡眠到唤醒时刻再继续
+    while (sc->IsRunning && sc->IsPaused)
+    {
+        SleepUntil(sc->PauseEndTime);
+        sc->IsPaused = FALSE;
+        ExecuteInstructions(sc, POLY_INFINITE_TIMESLICE, INFINITE_INSTR_BUDGET);
+    }
+}
+
+/******************************************************************************************
+*
+*  RunHostCall()
+*
+*  Calls a script function on behalf of the host and runs it until it returns. The caller
+*  has pushed the parameters and marked the script as running.
+*/
+
+static void RunHostCall(script_env *sc, int iFuncIndex)
+{
+    // Call the function
+    CallFunc(sc, iFuncIndex, OP_TYPE_STACK_BASE_MARKER);
+
+    RunToHostReturn(sc);
+}
+
 /******************************************************************************************
 *
 *  Poly_CallScriptFunc()
@@ -2024,22 +3222,240 @@ int GetFuncIndexByName(script_env *sc, const char *pstrName)
 
 int Poly_CallScriptFunc(script_env *sc, const char *pstrName)
 {
-    // Get the function's index based on it's name
-    int iFuncIndex = GetFuncIndexByName(sc, pstrName);
+    return Poly_CallScriptFuncByHandle(sc, GetFuncIndexByName(sc, pstrName));
+}
 
-    // Make sure the function name was valid
-    if (iFuncIndex == -1)
+/******************************************************************************************
+*
+*  Poly_GetFuncHandle()
+*
+*  Looks up a script function once so it can be called repeatedly without a name search.
+*  Returns POLY_INVALID_FUNC_HANDLE if there's no such function.
+*/
+
+POLY_FUNC_HANDLE Poly_GetFuncHandle(script_env *sc, const char *pstrName)
+{
+    // 句柄就是函数在程序函数表中的索引
+    return GetFuncIndexByName(sc, pstrName);
+}
+
+/******************************************************************************************
+*
+*  Poly_CallScriptFuncByHandle()
+*
+*  Calls a script function from the host application by its handle.
+*/
+
+int Poly_CallScriptFuncByHandle(script_env *sc, POLY_FUNC_HANDLE hFunc)
+{
+    int iFuncIndex = hFunc;
+
+    // Make sure the handle was valid
+    if (iFuncIndex < 0 || iFuncIndex >= sc->FuncTable.Size)
         return FALSE;
 
-    // Call the function
-    CallFunc(sc, iFuncIndex, OP_TYPE_STACK_BASE_MARKER);
+    // 脚本已经结束或正在睡眠时也允许调用其中的函数
+    int iWasRunning = sc->IsRunning;
+    int iWasPaused = sc->IsPaused;
+    int iPauseEndTime = sc->PauseEndTime;
+    sc->IsRunning = TRUE;
+    sc->IsPaused = FALSE;
 
-    // Allow the script code to execute uninterrupted until the function returns
-    ExecuteInstructions(sc, POLY_INFINITE_TIMESLICE);
+    RunHostCall(sc, iFuncIndex);
+
+    sc->IsPaused = iWasPaused;
+    sc->PauseEndTime = iPauseEndTime;
+    if (!iWasRunning)
+        sc->IsRunning = FALSE;
 
     return TRUE;
 }
 
+/******************************************************************************************
+*
+*  LoadBatchRow()
+*
+*  Writes the current row of a batch into the parameter slots of its frame.
+*/
+
+static void LoadBatchRow(script_env *sc, HOST_BATCH *pBatch)
+{
+    const PolyObject *pRow = pBatch->Args + pBatch->Row * pBatch->ArgCount;
+
+    for (int i = 0; i < pBatch->ArgCount; ++i)
+    {
+        PolyObject Arg = pRow[i];
+
+        // 同一列的指针和上一行相同时沿用已经创建的字符串
+        if (Arg.Type == OP_TYPE_STRING)
+        {
+            BATCH_STRING *pString = &pBatch->ArgStrings[i];
+            if (pString->Source != Arg.String)
+            {
+                if (pString->String)
+                    Str_Release(pString->String);
+                pString->Source = Arg.String;
+                pString->String = Str_FromCStr(Arg.String);
+            }
+            Arg.String = pString->String;
+        }
+
+        // 参数槽中上一行的值在覆盖时释放
+        CopyValue(&sc->stack[pBatch->ArgBase + i], &Arg);
+    }
+}
+
+/******************************************************************************************
+*
+*  NextBatchRow()
+*
+*  Called by RET when a function called from the host returns. If it is the function of
+*  the innermost batch and rows remain, stores the return value, loads the next row and
+*  returns the entry point to restart the function at, keeping its frame. Returns -1
+*  otherwise.
+*/
+
+int NextBatchRow(script_env *sc)
+{
+    HOST_BATCH *pBatch = sc->Batch;
+
+    if (!pBatch || sc->iFrameIndex != pBatch->FrameIndex)
+        return -1;
+
+    // 返回值归结果数组，字符串增加一个引用
+    if (pBatch->Results)
+        CopyValue(&pBatch->Results[pBatch->Row], &sc->_RetVal);
+
+    if (++pBatch->Row == pBatch->Count)
+        return -1;
+
+    LoadBatchRow(sc, pBatch);
+    return sc->FuncTable.Funcs[pBatch->FuncIndex].EntryPoint;
+}
+
+/******************************************************************************************
+*
+*  Poly_CallScriptFuncBatch()
+*
+*  Calls a script function once per row of iArgCount packed parameters and stores each
+*  return value in pResults (which may be NULL). The frame is set up once; between rows
+*  RET only rewrites the parameters and jumps back to the entry point, so the whole batch
+*  runs in one dispatch loop. Results are rooted while the batch runs. String results are
+*  references the caller releases with Poly_ReleaseResults(); object results are only
+*  valid until the script runs again. Returns the number of rows completed, which is less
+*  than iCount if the script stops.
+*/
+
+int Poly_CallScriptFuncBatch(script_env *sc, POLY_FUNC_HANDLE hFunc, const PolyObject *pArgs,
+                             int iArgCount, int iCount, PolyObject *pResults)
+{
+    int iFuncIndex = hFunc;
+
+    // 行的宽度必须和函数的参数个数一致，否则返回时会弹出错误的栈帧
+    if (iFuncIndex < 0 || iFuncIndex >= sc->FuncTable.Size)
+        return 0;
+    if (iArgCount != sc->FuncTable.Funcs[iFuncIndex].ParamCount || iCount <= 0)
+        return 0;
+    if (!EnsureStack(sc, iArgCount))
+        return 0;
+
+    // 结果数组在返回之前也是GC的根，先清空
+    if (pResults)
+    {
+        for (int i = 0; i < iCount; ++i)
+            pResults[i].Type = OP_TYPE_NULL;
+    }
+
+    HOST_BATCH Batch;
+    Batch.Prev = sc->Batch;
+    Batch.FuncIndex = iFuncIndex;
+    Batch.ArgBase = sc->iTopIndex;
+    Batch.Args = pArgs;
+    Batch.ArgCount = iArgCount;
+    Batch.Count = iCount;
+    Batch.Row = 0;
+    Batch.Results = pResults;
+    Batch.ArgStrings = NULL;
+    if (iArgCount)
+    {
+        Batch.ArgStrings = (BATCH_STRING *)calloc(iArgCount, sizeof(BATCH_STRING));
+        if (!Batch.ArgStrings)
+        {
+            fprintf(stderr, "VM: 内存不足\n");
+            exit(1);
+        }
+    }
+
+    int iWasRunning = sc->IsRunning;
+    int iWasPaused = sc->IsPaused;
+    int iPauseEndTime = sc->PauseEndTime;
+    sc->IsRunning = TRUE;
+    sc->IsPaused = FALSE;
+
+    // 压入第一行并建立栈帧，之后的行由NextBatchRow()就地改写参数
+    LoadBatchRow(sc, &Batch);
+    sc->iTopIndex += iArgCount;
+    CallFunc(sc, iFuncIndex, OP_TYPE_STACK_BASE_MARKER);
+    Batch.FrameIndex = sc->iFrameIndex;
+    sc->Batch = &Batch;
+
+    RunToHostReturn(sc);
+
+    sc->Batch = Batch.Prev;
+    for (int i = 0; i < iArgCount; ++i)
+    {
+        if (Batch.ArgStrings[i].String)
+            Str_Release(Batch.ArgStrings[i].String);
+    }
+    free(Batch.ArgStrings);
+
+    sc->IsPaused = iWasPaused;
+    sc->PauseEndTime = iPauseEndTime;
+    if (!iWasRunning)
+        sc->IsRunning = FALSE;
+
+    return Batch.Row;
+}
+
+/******************************************************************************************
+*
+*  Poly_GetResultAsStringView()
+*
+*  Returns a string result of Poly_CallScriptFuncBatch() as a view, without copying. The
+*  view is empty for other types.
+*/
+
+POLY_STRING_VIEW Poly_GetResultAsStringView(const PolyObject *pResult)
+{
+    POLY_STRING_VIEW View = { NULL, 0 };
+
+    if (pResult->Type == OP_TYPE_STRING)
+    {
+        View.Chars = pResult->String;
+        View.Length = Str_Length(pResult->String);
+    }
+
+    return View;
+}
+
+/******************************************************************************************
+*
+*  Poly_ReleaseResults()
+*
+*  Releases the string results of Poly_CallScriptFuncBatch(). Must be called on the thread
+*  running the script, as the script's strings aren't shared between threads.
+*/
+
+void Poly_ReleaseResults(PolyObject *pResults, int iCount)
+{
+    for (int i = 0; i < iCount; ++i)
+    {
+        if (pResults[i].Type == OP_TYPE_STRING)
+            Str_Release(pResults[i].String);
+        pResults[i].Type = OP_TYPE_NULL;
+    }
+}
+
 /******************************************************************************************
 *
 *  Poly_CallScriptFuncSync()
@@ -2051,11 +3467,22 @@ int Poly_CallScriptFunc(script_env *sc, const char *pstrName)
 
 void Poly_CallScriptFuncSync(script_env *sc, const char *pstrName)
 {
-    // Get the function's index based on its name
-    int iFuncIndex = GetFuncIndexByName(sc, pstrName);
+    Poly_CallScriptFuncSyncByHandle(sc, GetFuncIndexByName(sc, pstrName));
+}
 
-    // Make sure the function name was valid
-    if (iFuncIndex == -1)
+/******************************************************************************************
+*
+*  Poly_CallScriptFuncSyncByHandle()
+*
+*  Like Poly_CallScriptFuncSync(), with a function handle instead of a name.
+*/
+
+void Poly_CallScriptFuncSyncByHandle(script_env *sc, POLY_FUNC_HANDLE hFunc)
+{
+    int iFuncIndex = hFunc;
+
+    // Make sure the handle was valid
+    if (iFuncIndex < 0 || iFuncIndex >= sc->FuncTable.Size)
         return;
 
     // Call the function
@@ -2064,23 +3491,30 @@ void Poly_CallScriptFuncSync(script_env *sc, const char *pstrName)
 
 /******************************************************************************************
 *
-*  Poly_RegisterHostFunc()
+*  RegisterHostFunc()
 *
-*  Registers a function with the host API.
+*  Registers a generic or typed function with the host API.
 */
 
-int Poly_RegisterHostFunc(script_env *sc, const char *pstrName, POLY_HOST_FUNCTION fnFunc)
+static int RegisterHostFunc(script_env *sc, const char *pstrName, POLY_HOST_FUNCTION fnFunc,
+                            int iSignature, int iParamCount, HOST_NATIVE_FUNC fnNative)
 {
     HOST_API_FUNC **pCFuncTable;
 
     if (!pstrName)
         return FALSE;
 
-    // 全局API
+    // 全局API。已解析的绑定可能指向旧的函数或者被新注册的同名函数遮蔽，需要重新解析
     if (sc == POLY_GLOBAL_FUNC)
+    {
         pCFuncTable = &g_HostAPIs;
+        g_HostAPIEpoch++;
+    }
     else
+    {
         pCFuncTable = &sc->HostAPIs;
+        sc->HostBindingEpoch = 0;
+    }
 
     while (*pCFuncTable)
     {
@@ -2088,6 +3522,9 @@ int Poly_RegisterHostFunc(script_env *sc, const char *pstrName, POLY_HOST_FUNCTI
         if (strcmp((*pCFuncTable)->Name, pstrName) == 0)
         {
             (*pCFuncTable)->FuncPtr = fnFunc;
+            (*pCFuncTable)->Signature = iSignature;
+            (*pCFuncTable)->ParamCount = iParamCount;
+            (*pCFuncTable)->Native = fnNative;
             return TRUE;
         }
         pCFuncTable = &(*pCFuncTable)->Next;
@@ -2099,16 +3536,83 @@ int Poly_RegisterHostFunc(script_env *sc, const char *pstrName, POLY_HOST_FUNCTI
     memset(pFunc, 0, sizeof(HOST_API_FUNC));
     strcpy(pFunc->Name, pstrName);
     pFunc->FuncPtr = fnFunc;
+    pFunc->Signature = iSignature;
+    pFunc->ParamCount = iParamCount;
+    pFunc->Native = fnNative;
     pFunc->Next = NULL;
     return TRUE;
 }
 
-// 返回栈帧上指定的参数
+/******************************************************************************************
+*
+*  Poly_RegisterHostFunc()
+*
+*  Registers a function with the host API.
+*/
+
+int Poly_RegisterHostFunc(script_env *sc, const char *pstrName, POLY_HOST_FUNCTION fnFunc)
+{
+    return RegisterHostFunc(sc, pstrName, fnFunc, HOST_SIG_GENERIC, 0, NULL);
+}
+
+/******************************************************************************************
+*
+*  Poly_RegisterHostFuncI_V() ... Poly_RegisterHostFuncFF_F()
+*
+*  Register typed host functions, called with native arguments and return values.
+*/
+
+int Poly_RegisterHostFuncI_V(script_env *sc, const char *pstrName, void (*fnFunc)(int))
+{
+    return RegisterHostFunc(sc, pstrName, NULL, HOST_SIG_I_V, 1, (HOST_NATIVE_FUNC)fnFunc);
+}
+
+int Poly_RegisterHostFuncS_V(script_env *sc, const char *pstrName, void (*fnFunc)(const char *))
+{
+    return RegisterHostFunc(sc, pstrName, NULL, HOST_SIG_S_V, 1, (HOST_NATIVE_FUNC)fnFunc);
+}
+
+int Poly_RegisterHostFuncI_I(script_env *sc, const char *pstrName, int (*fnFunc)(int))
+{
+    return RegisterHostFunc(sc, pstrName, NULL, HOST_SIG_I_I, 1, (HOST_NATIVE_FUNC)fnFunc);
+}
+
+int Poly_RegisterHostFuncII_I(script_env *sc, const char *pstrName, int (*fnFunc)(int, int))
+{
+    return RegisterHostFunc(sc, pstrName, NULL, HOST_SIG_II_I, 2, (HOST_NATIVE_FUNC)fnFunc);
+}
+
+int Poly_RegisterHostFuncIII_I(script_env *sc, const char *pstrName, int (*fnFunc)(int, int, int))
+{
+    return RegisterHostFunc(sc, pstrName, NULL, HOST_SIG_III_I, 3, (HOST_NATIVE_FUNC)fnFunc);
+}
+
+int Poly_RegisterHostFuncS_I(script_env *sc, const char *pstrName, int (*fnFunc)(const char *))
+{
+    return RegisterHostFunc(sc, pstrName, NULL, HOST_SIG_S_I, 1, (HOST_NATIVE_FUNC)fnFunc);
+}
+
+int Poly_RegisterHostFuncF_F(script_env *sc, const char *pstrName, float (*fnFunc)(float))
+{
+    return RegisterHostFunc(sc, pstrName, NULL, HOST_SIG_F_F, 1, (HOST_NATIVE_FUNC)fnFunc);
+}
+
+int Poly_RegisterHostFuncFF_F(script_env *sc, const char *pstrName, float (*fnFunc)(float, float))
+{
+    return RegisterHostFunc(sc, pstrName, NULL, HOST_SIG_FF_F, 2, (HOST_NATIVE_FUNC)fnFunc);
+}
+
+// 返回栈帧上指定的参数，索引0是最后一个实参
 PolyObject Poly_GetParam(script_env *sc, int iParamIndex)
 {
-    int iTopIndex = sc->iTopIndex;
-    // TODO 检查索引边界
-    PolyObject arg = sc->stack[iTopIndex - (iParamIndex + 1)];
+    if (iParamIndex < 0 || iParamIndex >= sc->HostArgCount)
+    {
+        PolyObject Null;
+        Null.Type = OP_TYPE_NULL;
+        return Null;
+    }
+
+    PolyObject arg = sc->stack[sc->HostArgBase + sc->HostArgCount - (iParamIndex + 1)];
     return arg;
 }
 
@@ -2153,7 +3657,9 @@ float Poly_GetParamAsFloat(script_env *sc, int iParamIndex)
 *
 *  Poly_GetParamAsString()
 *
-*  Returns the specified string parameter to a host API function.
+*  Returns the specified string parameter to a host API function. The string belongs to
+*  the script and stays valid until the host function returns; numbers are converted
+*  without allocating. Copy it to keep it longer.
 */
 
 char *Poly_GetParamAsString(script_env *sc, int iParamIndex)
@@ -2162,7 +3668,21 @@ char *Poly_GetParamAsString(script_env *sc, int iParamIndex)
     PolyObject Param = Poly_GetParam(sc, iParamIndex);
 
     // Coerce the top element of the stack to a string
-    return CoerceValueToString(&Param);
+    return CoerceValueToString(sc, &Param);
+}
+
+/******************************************************************************************
+*
+*  Poly_GetParamAsStringView()
+*
+*  Returns the specified parameter as a borrowed string with its length, valid until the
+*  host function returns.
+*/
+
+POLY_STRING_VIEW Poly_GetParamAsStringView(script_env *sc, int iParamIndex)
+{
+    PolyObject Param = Poly_GetParam(sc, iParamIndex);
+    return GetValueAsStringView(sc, &Param);
 }
 
 /******************************************************************************************
@@ -2174,8 +3694,7 @@ char *Poly_GetParamAsString(script_env *sc, int iParamIndex)
 
 void Poly_ReturnFromHost(script_env *sc)
 {
-    // Clear the parameters off the stack
-    sc->iTopIndex = sc->iFrameIndex;
+    // 宿主函数返回后由虚拟机清除栈上的实参
 }
 
 /******************************************************************************************
@@ -2187,9 +3706,11 @@ void Poly_ReturnFromHost(script_env *sc)
 
 void Poly_ReturnIntFromHost(script_env *sc, int iInt)
 {
-    // Put the return value and type in _RetVal
-    sc->_RetVal.Type = OP_TYPE_INT;
-    sc->_RetVal.Fixnum = iInt;
+    // Put the return value and type in _RetVal, releasing a string it may hold
+    PolyObject ReturnValue;
+    ReturnValue.Type = OP_TYPE_INT;
+    ReturnValue.Fixnum = iInt;
+    CopyValue(&sc->_RetVal, &ReturnValue);
 
     Poly_ReturnFromHost(sc);
 }
@@ -2203,9 +3724,11 @@ void Poly_ReturnIntFromHost(script_env *sc, int iInt)
 
 void Poly_ReturnFloatFromHost(script_env *sc, float fFloat)
 {
-    // Put the return value and type in _RetVal
-    sc->_RetVal.Type = OP_TYPE_FLOAT;
-    sc->_RetVal.Realnum = fFloat;
+    // Put the return value and type in _RetVal, releasing a string it may hold
+    PolyObject ReturnValue;
+    ReturnValue.Type = OP_TYPE_FLOAT;
+    ReturnValue.Realnum = fFloat;
+    CopyValue(&sc->_RetVal, &ReturnValue);
 
     // Clear the parameters off the stack
     Poly_ReturnFromHost(sc);
@@ -2218,7 +3741,7 @@ void Poly_ReturnFloatFromHost(script_env *sc, float fFloat)
 *  Returns a string from a host API function.
 */
 
-void Poly_ReturnStringFromHost(script_env *sc, char *pstrString)
+void Poly_ReturnStringFromHost(script_env *sc, const char *pstrString)
 {
     if (!pstrString)
     {
@@ -2226,19 +3749,140 @@ void Poly_ReturnStringFromHost(script_env *sc, char *pstrString)
         exit(0);
     }
 
+    Poly_ReturnStringViewFromHost(sc, pstrString, strlen(pstrString));
+}
+
+/******************************************************************************************
+*
+*  Poly_ReturnStringViewFromHost()
+*
+*  Returns iLength characters from a host API function. They are copied once, so the
+*  buffer needn't outlive the call.
+*/
+
+void Poly_ReturnStringViewFromHost(script_env *sc, const char *pstrChars, size_t iLength)
+{
     // Put the return value and type in _RetVal
     PolyObject ReturnValue;
     ReturnValue.Type = OP_TYPE_STRING;
-    ReturnValue.String = pstrString;
+    ReturnValue.String = Str_New(pstrChars, (int)iLength);
     CopyValue(&sc->_RetVal, &ReturnValue);
+    Str_Release(ReturnValue.String);
 
     // Clear the parameters off the stack
     Poly_ReturnFromHost(sc);
 }
 
+/******************************************************************************************
+*
+*  Poly_ReturnStaticStringFromHost()
+*
+*  Returns a string created by Poly_CreateStaticString() without copying it.
+*/
+
+void Poly_ReturnStaticStringFromHost(script_env *sc, const char *pstrStatic)
+{
+    PolyObject ReturnValue;
+    ReturnValue.Type = OP_TYPE_STRING;
+    ReturnValue.String = (char *)pstrStatic;
+    CopyValue(&sc->_RetVal, &ReturnValue);
+
+    Poly_ReturnFromHost(sc);
+}
+
+/******************************************************************************************
+*
+*  Poly_ReturnObjectFromHost()
+*
+*  Returns an object reference from a host API function.
+*/
+
+void Poly_ReturnObjectFromHost(script_env *sc, PolyObject Object)
+{
+    CopyValue(&sc->_RetVal, &Object);
+
+    Poly_ReturnFromHost(sc);
+}
+
+/******************************************************************************************
+*
+*  Poly_NewObject()
+*
+*  Allocates an object with iFieldCount fields, all holding the integer 0, and may run
+*  a collection first. Nursery objects move when they are promoted, so object values
+*  the host read before the call are stale afterwards and must be read again from the
+*  parameters or from fields of rooted objects.
+*/
+
+PolyObject Poly_NewObject(script_env *sc, int iFieldCount)
+{
+    if (iFieldCount <= 0)
+    {
+        PolyObject Null;
+        Null.Type = OP_TYPE_NULL;
+        return Null;
+    }
+
+    return NewObject(sc, iFieldCount);
+}
+
+/******************************************************************************************
+*
+*  IsStaleObject()
+*
+*  Returns TRUE if a young object reference held by the host outlived a minor collection
+*  and points into the emptied part of the nursery or at a promoted object. A reference
+*  into the part allocated again can't be told apart from a new object.
+*/
+
+static int IsStaleObject(script_env *sc, MetaObject *pObject)
+{
+    return GC_IsYoung(&sc->Heap, pObject) &&
+           ((char *)pObject >= sc->Heap.NurseryTop || (pObject->Flags & GC_FORWARDED));
+}
+
+/******************************************************************************************
+*
+*  Poly_GetObjectField()
+*
+*  Returns the specified field of an object, or null if Object is not an object, is a
+*  stale reference or the index is out of range.
+*/
+
+PolyObject Poly_GetObjectField(script_env *sc, PolyObject Object, int iFieldIndex)
+{
+    if (Object.Type != OP_TYPE_OBJECT || IsStaleObject(sc, Object.ObjectPtr) ||
+        iFieldIndex < 0 || (size_t)iFieldIndex >= Object.ObjectPtr->Size)
+    {
+        PolyObject Null;
+        Null.Type = OP_TYPE_NULL;
+        return Null;
+    }
+
+    return Object.ObjectPtr->Mem[iFieldIndex];
+}
+
+/******************************************************************************************
+*
+*  Poly_SetObjectField()
+*
+*  Stores Value in the specified field of an object through the write barrier. Returns
+*  FALSE if Object is not an object, is a stale reference or the index is out of range.
+*/
+
+int Poly_SetObjectField(script_env *sc, PolyObject Object, int iFieldIndex, PolyObject Value)
+{
+    if (Object.Type != OP_TYPE_OBJECT || IsStaleObject(sc, Object.ObjectPtr) ||
+        iFieldIndex < 0 || (size_t)iFieldIndex >= Object.ObjectPtr->Size)
+        return FALSE;
+
+    GC_WriteField(&sc->Heap, Object.ObjectPtr, iFieldIndex, &Value);
+    return TRUE;
+}
+
 int Poly_GetParamCount(script_env *sc)
 {
-    return (sc->iTopIndex - sc->iFrameIndex);
+    return sc->HostArgCount;
 }
 
 int Poly_IsScriptStop(script_env *sc)
@@ -2251,6 +3895,99 @@ int Poly_GetExitCode(script_env *sc)
     return sc->ExitCode;
 }
 
+/******************************************************************************************
+*
+*  Poly_SetPriority()
+*
+*  Sets the priority a scheduler runs the script with, overriding the script header.
+*/
+
+void Poly_SetPriority(script_env *sc, int iPriorityType, int iUserPriority)
+{
+    if (iPriorityType < POLY_PRIORITY_NONE || iPriorityType > POLY_PRIORITY_HIGH)
+        return;
+
+    sc->PriorityType = iPriorityType;
+    sc->UserPriority = iUserPriority;
+}
+
+/******************************************************************************************
+*
+*  Poly_SetEngine()
+*
+*  Selects the dispatch engine used to execute the script.
+*/
+
+void Poly_SetEngine(script_env *sc, int iEngine)
+{
+    if (iEngine == POLY_ENGINE_SWITCH || iEngine == POLY_ENGINE_THREADED)
+        sc->Engine = iEngine;
+}
+
+/******************************************************************************************
+*
+*  Poly_GetInstrCount()
+*
+*  Returns the number of instructions executed so far.
+*/
+
+unsigned long long Poly_GetInstrCount(script_env *sc)
+{
+    return sc->InstrCount;
+}
+
+/******************************************************************************************
+*
+*  Poly_SetFusion()
+*
+*  Enables or disables superinstruction fusion for this script. Before loading, the setting
+*  is used to compile the program. For a loaded script whose program was lowered with the
+*  other setting, the program is lowered again into buffers of the script's own; the
+*  shared program is never modified, so other instances are unaffected. Instruction
+*  indices do not change, so this is safe between runs.
+*/
+
+void Poly_SetFusion(script_env *sc, int iEnable)
+{
+    sc->Fusion = iEnable ? TRUE : FALSE;
+
+    if (!sc->Program)
+        return;
+
+    script_env *pImage = &sc->Program->Image;
+
+    // 与程序的设置相同时回到共享的代码
+    if (sc->Fusion == pImage->Fusion)
+    {
+        if (HasPrivateCode(sc))
+            FreeCodeStream(sc);
+        sc->Code = pImage->Code;
+        return;
+    }
+
+    // 第一次降级时分配自己的缓冲区，之后重用
+    if (!HasPrivateCode(sc))
+        memset(&sc->Code, 0, sizeof(sc->Code));
+
+    if (!LowerInstrStream(sc))
+    {
+        fprintf(stderr, "VM: 内存不足\n");
+        exit(1);
+    }
+}
+
+/******************************************************************************************
+*
+*  Poly_GetFusionCount()
+*
+*  Returns the number of superinstructions in the code the script runs.
+*/
+
+int Poly_GetFusionCount(script_env *sc)
+{
+    return sc->Code.FusionCount;
+}
+
 int Poly_LoadScript(script_env *sc, const char *pstrFilename)
 {
     //char pstrExecFilename[MAX_PATH];
@@ -2274,17 +4011,18 @@ int Poly_LoadScript(script_env *sc, const char *pstrFilename)
 
     //XSC_CompileScript(pstrFilename, pstrExecFilename);
 
-    // 编译
-    CompilerOption option;
-    option.save_debug_info = TRUE;
-    XSC_CompileScript(sc, pstrFilename, &option);
-
     // 载入PE文件
     //LoadPE(sc, pstrExecFilename);
 
-    // 分配堆栈
-    int iStackSize = sc->iStackSize;
-    if (!(sc->stack = (PolyObject *)malloc(iStackSize * sizeof(PolyObject))))
+    // 编译为只属于这个脚本的程序
+    poly_program *prog = CompileProgram(pstrFilename, sc->Fusion);
+    if (!prog)
+        return POLY_LOAD_ERROR_OUT_OF_MEMORY;
+
+    int iAttached = AttachProgram(sc, prog);
+    Poly_ReleaseProgram(prog);
+
+    if (!iAttached)
         return POLY_LOAD_ERROR_OUT_OF_MEMORY;
 
     //DisplayStatus(sc);
@@ -15,6 +15,15 @@
 #define MAC_PLATFORM 1
 #endif
 
+// ----Dispatch ---------------------------------------------------------------
+
+// GCC/Clang支持labels-as-values，线索化引擎使用computed goto分发指令；
+// 其他编译器（或定义了POLY_NO_COMPUTED_GOTO时）退回到可移植的switch分发
+
+#if !defined(POLY_NO_COMPUTED_GOTO) && (defined(__GNUC__) || defined(__clang__))
+#define POLY_COMPUTED_GOTO 1
+#endif
+
 // ----Include Files ----------------------------------------------------------
 
 #include <stdlib.h>
@@ -23,6 +32,7 @@
 #include <math.h>
 #include <stdarg.h>
 #include <assert.h>
+#include <atomic>
 
 #include "poly.h"
 
@@ -48,7 +58,8 @@
 struct MetaObject
 {
     long RefCount;
-    unsigned char marked;
+    unsigned int Id;               // 对象编号，索引堆的标记位图。新生代对象没有编号
+    unsigned int Flags;            // GC_FORWARDED、GC_REMEMBERED(gc.h)
     //Reference* Type;
     //char* Name;
     PolyObject *Mem;               // 对象数据
@@ -56,6 +67,50 @@ struct MetaObject
     struct MetaObject *NextObject; // 指向下一个元对象
 };
 
+// 对象指针的栈，按倍数增长
+struct GC_STACK
+{
+    MetaObject **Items;
+    int Top;
+    int Capacity;
+};
+
+#define GC_SIZE_CLASSES 16 // 字段不超过这么多个的老年代对象从slab中分配
+
+// 脚本的堆(gc.cpp)。新对象在新生代中顺序分配，存活的对象被复制到老年代。
+// 老年代对象的标记位集中在位图中，标记阶段不写对象
+struct GC_HEAP
+{
+    char *Nursery;       // 新生代，第一次分配对象时才分配
+    char *NurseryTop;    // 下一个新对象的地址
+    char *NurseryEnd;
+    int YoungCount;      // 新生代中的对象个数
+    int YoungStrings;    // 新生代对象的字段中可能有字符串
+    GC_STACK Remembered; // 字段可能引用新生代对象的老年代对象
+    GC_STACK Promoted;   // 晋升到老年代、字段尚未扫描的对象
+
+    MetaObject *Objects; // 最近分配的老年代对象，NextObject串起全部老年代对象
+    int ObjectCount;     // 老年代对象的个数
+    struct GC_SLAB *Slabs;                   // 老年代小对象所在的slab，销毁堆时整体释放
+    MetaObject *FreeBlocks[GC_SIZE_CLASSES]; // 每个大小类(字段个数)的空闲块
+
+    unsigned int *MarkBits;  // 标记位图，每个对象编号一位
+    int MarkWords;           // 位图的长度
+    unsigned int *FreeIds;   // 已回收的对象编号，容量与位图的位数相同
+    int FreeIdCount;
+    unsigned int NextId;     // 从未使用过的最小编号
+
+    GC_STACK Grey;           // 已标记、字段尚未扫描的对象
+    int GreyOverflow;        // 灰色栈曾经无法增长
+
+    int Phase;                 // 老年代回收所处的阶段(GC_PHASE_*)
+    MetaObject **SweepCursor;  // 增量清除的位置
+
+    size_t OldBytes;           // 老年代对象的字节数
+    size_t NurseryBytes;       // 新生代中尚未晋升的对象的字节数
+    POLY_GC_STATS Stats;       // HeapBytes由Poly_GetGCStats()计算，这里不维护
+};
+
 // ----Script Loading --------------------------------------------------------------------
 
 #define POLY_ID_STRING "POLYSCRIPT" // Used to validate an .MAX executable
@@ -64,16 +119,23 @@ struct MetaObject
 
 #define THREAD_MODE_SINGLE 1 // Single-threaded execution
 
-// 启动GC过程的临界对象数
-#define INITIAL_GC_THRESHOLD 25
+// 启动GC过程的老年代字节数的缺省下限
+#define INITIAL_GC_THRESHOLD (1024 * 1024)
+#define GC_DEFAULT_GROWTH 200 // 缺省的临界值：存活字节数的200%
+#define GC_MIN_GROWTH 110     // 增长太小时回收过于频繁
+
+#define GC_STEP_BYTES 4096 // 回收进行中脚本每分配这么多字节推进一步
+#define GC_STEP_WORK 256   // 每一步的工作量(扫描或清除的对象个数)
 
 // ----Stack -----------------------------------------------------------------------------
 
-#define DEF_STACK_SIZE 1024 // The default stack size
+#define DEF_STACK_SIZE 64       // 初始堆栈大小，调用函数时按需增长(见GrowStack())
+#define MAX_STACK_SIZE (1 << 20) // 堆栈最多容纳的值，超过时脚本因栈溢出而停止
 
 // ----Coercion --------------------------------------------------------------------------
 
-#define MAX_COERCION_STRING_SIZE 256 // The maximum allocated space for a string coercion
+// 数字转换成字符串时使用的暂存区大小，可以同时保存十几个转换结果(见CoerceValueToString())
+#define COERCION_SCRATCH_SIZE 512
 
 // ----Functions -------------------------------------------------------------------------
 
@@ -98,6 +160,7 @@ struct FUNC // A function
     int ParamCount;                // The parameter count
     int LocalDataSize;             // Total size of all local data
     int StackFrameSize;            // Total size of the stack frame
+    int MaxStackDepth;             // 调用时栈顶之上最多需要的槽位：返回地址、局部数据、函数信息块和表达式
     char Name[MAX_FUNC_NAME_SIZE]; // The function's name
 };
 
@@ -115,6 +178,24 @@ struct INSTR_STREAM // An instruction stream
     int Size;      // The number of instructions in the stream
 };
 
+// ----Pre-decoded Instructions ----------------------------------------------------------
+struct CODE // 预解码的指令
+{
+    int Opcode; // 操作码，操作数的种类已编码在其中
+    int A;      // 第一个操作数：栈索引、指令索引、函数索引或常量池索引
+    int B;      // 第二个操作数
+    int C;      // 第三个操作数(超级指令)
+};
+
+struct CODE_STREAM // 载入时由指令流降级得到，与指令流按索引一一对应
+{
+    CODE *Codes;        // 连续存放的指令，末尾是INSTR_HALT哨兵
+    int Size;           // 指令条数(不含哨兵)
+    PolyObject *Consts; // 常量池：立即数以及通用指令的操作数
+    int ConstCount;     // 常量池的大小
+    int FusionCount;    // 融合生成的超级指令条数
+};
+
 // ----Function Table --------------------------------------------------------------------
 struct FUNC_TABLE // A function table
 {
@@ -122,7 +203,7 @@ struct FUNC_TABLE // A function table
     int Size;    // The number of functions in the array
 };
 
-// 常量字符串表
+// 常量字符串表，载入时驻留的字符串(polystr.h)，字符串操作数直接指向它们
 struct STRING_TABLE
 {
     char **StringPool;
@@ -137,13 +218,31 @@ struct HOST_CALL_TABLE // A host API call table
 };
 
 // ----Host API --------------------------------------------------------------------------
+// 宿主函数的签名，决定虚拟机如何调用它
+#define HOST_SIG_GENERIC 0 // POLY_HOST_FUNCTION，通过Poly_GetParam*()读取参数
+#define HOST_SIG_I_V 1     // void (*)(int)
+#define HOST_SIG_S_V 2     // void (*)(const char *)
+#define HOST_SIG_I_I 3     // int (*)(int)
+#define HOST_SIG_II_I 4    // int (*)(int, int)
+#define HOST_SIG_III_I 5   // int (*)(int, int, int)
+#define HOST_SIG_S_I 6     // int (*)(const char *)
+#define HOST_SIG_F_F 7     // float (*)(float)
+#define HOST_SIG_FF_F 8    // float (*)(float, float)
+
+typedef void (*HOST_NATIVE_FUNC)(); // 有类型的宿主函数，调用前按签名转换回原来的类型
+
 struct HOST_API_FUNC // Host API function
 {
     char Name[MAX_FUNC_NAME_SIZE]; // The function name
     POLY_HOST_FUNCTION FuncPtr;    // Pointer to the function definition
+    int Signature;                 // 签名(HOST_SIG_*)
+    int ParamCount;                // 有类型的宿主函数的参数个数
+    HOST_NATIVE_FUNC Native;       // 有类型的宿主函数
     HOST_API_FUNC *Next;           // The next record
 };
 
+struct SCHED_ENTRY;
+
 // ----Script Virtual Machine State ---------------------------------------------------------------------------
 
 struct script_env
@@ -154,16 +253,45 @@ struct script_env
     int MainFuncIndex;     // Main()'s function index
 
     int IsRunning;        // Is the script running?
+    int IsMainActive;     // Main()已经开始执行且尚未返回(可以从中断处继续)
     int IsPaused;         // Is the script currently paused?
     int PauseEndTime;     // If so, when should it resume?
     int ThreadActiveTime; // 脚本运行的总时间
 
     // Threading
-    int TimesliceDur; // The thread's timeslice duration
+    int TimesliceDur;        // The thread's timeslice duration
+    int PriorityType;        // 调度优先级(POLY_PRIORITY_*)
+    int UserPriority;        // 用户定义的优先级，调度器用作指令预算
+    SCHED_ENTRY *SchedEntry; // 所属调度器中的节点
+
+    // 指令分发
+    int Engine;                    // 使用的分发引擎(POLY_ENGINE_*)
+    int Fusion;                    // 降级时是否融合超级指令
+    unsigned long long InstrCount; // 已执行的指令条数
 
     // 脚本特定的宿主API
     HOST_API_FUNC *HostAPIs;
 
+    // 宿主调用绑定表，以HostCallTable的索引访问，首次调用时按名字解析。
+    // HostBindingEpoch与g_HostAPIEpoch不同时整个表失效
+    HOST_API_FUNC **HostBindings;
+    unsigned int HostBindingEpoch;
+
+    // 正在执行的宿主函数的实参在栈上的位置
+    int HostArgBase;
+    int HostArgCount;
+
+    // 数字转换成的字符串存放在这里，不分配内存。宿主函数返回时收回它占用的部分。
+    // 暂存区用完后另外分配溢出块，同样在宿主函数返回时释放(见CoerceValueToString())
+    char CoercionScratch[COERCION_SCRATCH_SIZE];
+    int CoercionTop;
+    struct COERCION_BLOCK *CoercionOverflow; // 最近分配的溢出块在前
+    int HostCallDepth;                       // 正在执行的(嵌套的)宿主函数个数
+    struct HOST_BATCH *Batch;                // 正在执行的批量调用，嵌套的在前
+
+    // 共享的程序。下面的各个表只是程序中同名表的副本，指向的内存归程序所有
+    poly_program *Program;
+
     // Registers
     PolyObject _RetVal; // The _RetVal register (R0)
     int CurrInstr;      // 当前指令(IP)
@@ -179,15 +307,29 @@ struct script_env
 
     // Script data
     INSTR_STREAM InstrStream;      // The instruction stream
+    CODE_STREAM Code;              // 预解码的指令流
     FUNC_TABLE FuncTable;          // The function table
     HOST_CALL_TABLE HostCallTable; // The host API call table
 
     STRING_TABLE StringTable; // 字符串常量表
 
     // 动态内存分配
-    MetaObject *pLastObject; // 指向最近一个已分配的对象
-    int iNumberOfObjects;    // 当前已分配的对象个数
-    int iMaxObjects;         // 最大对象数，用于启动GC过程
+    GC_HEAP Heap;            // 脚本的对象
+    size_t GCThreshold;      // 老年代达到这么多字节时开始回收
+    size_t GCMinThreshold;   // GCThreshold的下限
+    int GCGrowth;            // 每轮回收后GCThreshold为存活字节数的百分之几
+    unsigned long long GCNextStep; // 回收进行中，累计分配字节数达到这里时推进一步
+    int GCTimeslice;         // 每次运行脚本后推进回收的时间(微秒)，0表示不推进
+};
+
+// ----Program ---------------------------------------------------------------------------
+
+// 编译一次、由多个脚本实例共享的只读程序。Image是一个从不运行的script_env，只有头部
+// 字段和各个表有效；实例创建时复制这些表的描述符，执行时不必经过程序再间接寻址
+struct poly_program
+{
+    std::atomic<int> RefCount;
+    script_env Image;
 };
 
 #endif /* __POLY_VM_H__ */